@@ -56,12 +56,27 @@ uint16_t _indirect_idx_adr(CPU& self, const uint8_t bb, const uint8_t i) {
     return _abs_adr(cpu_read(self, bb), cpu_read(self, bb+1)) + i;
 }
 
+static void _cpu_read_arg(CPU& self, const Instruction& inst) {
+    if (!inst.writes_only) {
+        self.arg_value = cpu_read(self, self.arg_addr);
+    }
+}
+
 void cpu_clock(CPU& self) {
     if (self.cycles > 0) {
         self.cycles--;
         return;
     }
 
+    if (self.nmi_pending) {
+        cpu_nmi(self);
+        return;
+    }
+    if (self.irq_line && !self.regs.flags.bits.i) {
+        cpu_irq(self);
+        return;
+    }
+
     auto& inst = instruction_set[cpu_fetch(self)];
 
     // prepare arg
@@ -80,47 +95,47 @@ void cpu_clock(CPU& self) {
         break;
     case AddressMode::ZeroPage:
         self.arg_addr = _zero_page_adr(cpu_fetch(self));
-        self.arg_value = cpu_read(self, self.arg_addr);
+        _cpu_read_arg(self, inst);
         break;
     case AddressMode::ZeroPageX:
         self.arg_addr = _idx_zero_page_adr(cpu_fetch(self), self.regs.x);
-        self.arg_value = cpu_read(self, self.arg_addr);
+        _cpu_read_arg(self, inst);
         break;
     case AddressMode::ZeroPageY:
         self.arg_addr = _idx_zero_page_adr(cpu_fetch(self), self.regs.y);
-        self.arg_value = cpu_read(self, self.arg_addr);
+        _cpu_read_arg(self, inst);
         break;
     case AddressMode::Absolute: {
         auto bb = cpu_fetch(self), cc = cpu_fetch(self);
         self.arg_addr = _abs_adr(bb, cc);
-        self.arg_value = cpu_read(self, self.arg_addr);
+        _cpu_read_arg(self, inst);
         break;
     }
     case AddressMode::AbsoluteX: {
         auto bb = cpu_fetch(self), cc = cpu_fetch(self);
         self.arg_addr = _idx_abs_adr(bb, cc, self.regs.x);
-        self.arg_value = cpu_read(self, self.arg_addr);
+        _cpu_read_arg(self, inst);
         break;
     }
     case AddressMode::AbsoluteY: {
         auto bb = cpu_fetch(self), cc = cpu_fetch(self);
         self.arg_addr = _idx_abs_adr(bb, cc, self.regs.y);
-        self.arg_value = cpu_read(self, self.arg_addr);
+        _cpu_read_arg(self, inst);
         break;
     }
     case AddressMode::Indirect: {
         auto bb = cpu_fetch(self), cc = cpu_fetch(self);
         self.arg_addr = _indirect_adr(self, bb, cc);
-        self.arg_value = cpu_read(self, self.arg_addr);
+        _cpu_read_arg(self, inst);
         break;
     }
     case AddressMode::IndexedIndirect:
         self.arg_addr = _idx_indirect_adr(self, cpu_fetch(self), self.regs.x);
-        self.arg_value = cpu_read(self, self.arg_addr);
+        _cpu_read_arg(self, inst);
         break;
     case AddressMode::IndirectIndexed:
         self.arg_addr = _indirect_idx_adr(self, cpu_fetch(self), self.regs.y);
-        self.arg_value = cpu_read(self, self.arg_addr);
+        _cpu_read_arg(self, inst);
         break;
     }
 
@@ -136,6 +151,27 @@ void cpu_clock(CPU& self) {
     }
 }
 
+void cpu_nmi(CPU& self) {
+    self.nmi_pending = false;
+
+    cpu_push16(self, self.regs.pc);
+    cpu_push(self, self.regs.flags.byte & ~(1 << 4)); // b flag is cleared for interrupts
+    self.regs.flags.bits.i = 1;
+    self.regs.pc = cpu_read16(self, NMI);
+
+    self.cycles += 7;
+}
+
+void cpu_irq(CPU& self) {
+    // the line stays up until the source acknowledges it, i keeps it from retriggering
+    cpu_push16(self, self.regs.pc);
+    cpu_push(self, self.regs.flags.byte & ~(1 << 4));
+    self.regs.flags.bits.i = 1;
+    self.regs.pc = cpu_read16(self, IRQ);
+
+    self.cycles += 7;
+}
+
 // TODO: is this only for JMP?
 void cpu_reprepare_jmp_arg(CPU& self) {
     auto fpc = self.regs.pc-2;
@@ -177,8 +213,8 @@ void cpu_write_arg(CPU& self, uint8_t v) {
 uint8_t cpu_read(CPU& self, uint16_t address) {
     uint8_t data = 0;
     bool success = rom_read(self.console->rom, address, data)
-        || ram_read(self.console->ram, address, data);
-        // || ppu_read(self.console->ppu, address, data);
+        || ram_read(self.console->ram, address, data)
+        || ppu_read(self.console->ppu, address, data);
     if (!success) {
        mu::log_warning("read from unregistered address 0x{:02X}", address);
     }
@@ -189,10 +225,81 @@ uint16_t cpu_read16(CPU& self, uint16_t address) {
     return cpu_read(self, address) | cpu_read(self, address+1) << 8;
 }
 
+// host memory backing a whole 256-byte cpu page, or null if it's not plain memory
+static const uint8_t* _cpu_page_ptr(CPU& self, uint8_t page) {
+    const uint16_t address = page << 8;
+    if (region_contains(RAM_REGION, address)) {
+        return &self.console->ram[address & RRAM.end];
+    }
+
+    const auto& rom = self.console->rom;
+    if (!rom.prg.empty() && region_contains(PRG_REGION, address)) {
+        return &rom.prg_banks[(address >> 13) & 0b11][address & 0x1FFF];
+    }
+    if (!rom.prg_ram.empty() && region_contains(SRAM, address)) {
+        return &rom.prg_ram[address - SRAM.start];
+    }
+
+    return nullptr;
+}
+
+// https://www.nesdev.org/wiki/PPU_registers#OAMDMA
+static bool _oam_dma_write(CPU& self, uint16_t address, uint8_t page) {
+    if (address != SPRITE_DMA_REG) {
+        return false;
+    }
+
+    auto& ppu = self.console->ppu;
+    uint8_t* oam = (uint8_t*) ppu.oam.data();
+
+    uint8_t buf[256];
+    const uint8_t* src = _cpu_page_ptr(self, page);
+    if (src == nullptr) {
+        for (int i = 0; i < 256; i++) {
+            buf[i] = cpu_read(self, (page << 8) | i);
+        }
+        src = buf;
+    }
+
+    // copy goes through $2004, so it starts at OAMADDR and wraps around
+    memcpy(oam + ppu.oam_addr, src, 256 - ppu.oam_addr);
+    memcpy(oam, src + 256 - ppu.oam_addr, ppu.oam_addr);
+    dirty_bitmap_mark_all(self.console->dirty.oam);
+
+    // the render worker replays it the slow way
+    if (ppu.command_log) {
+        for (int i = 0; i < 256; i++) {
+            ppu.command_log->push_back(PPUCommand {
+                .kind = PPUCommand::Kind::WRITE,
+                .data = src[i],
+                .addr = SPRRAM_IO_REG,
+                .row = ppu.row,
+                .col = ppu.col,
+            });
+        }
+    }
+
+    // 1 wait cycle, +1 if on an odd cycle, then 256 reads and 256 writes
+    const bool odd_cycle = self.console->cpu_cycles % 2 == 1;
+    self.cycles += 513 + odd_cycle;
+
+    return true;
+}
+
 void cpu_write(CPU& self, uint16_t address, uint8_t data)  {
-    bool success = rom_write(self.console->rom, address, data)
-        || ram_write(self.console->ram, address, data);
-        // || ppu_read(self.console->ppu, address, data);
+    if constexpr (WRITE_TRACKING) {
+        if (region_contains(RAM_REGION, address)) {
+            dirty_bitmap_mark(self.console->dirty.ram, address & RRAM.end);
+        } else if (region_contains(SRAM, address)) {
+            dirty_bitmap_mark(self.console->dirty.prg_ram, address - SRAM.start);
+        }
+    }
+
+    bool success = mapper_write(*self.console, address, data)
+        || rom_write(self.console->rom, address, data)
+        || ram_write(self.console->ram, address, data)
+        || ppu_write(self.console->ppu, address, data)
+        || _oam_dma_write(self, address, data);
     if (!success) {
        mu::log_warning("write to unregistered address 0x{:02X}", address);
     }
@@ -1,35 +1,323 @@
 #include "Console.h"
 
 #include <bitset>
+#include <type_traits>
 
-void console_init(Console& self, const mu::Str& rom_path) {
+// so the cpu runs on the very first dot
+static int _console_first_cpu_phase(TVSystem tv_system) {
+    const auto& sys = video_system(tv_system);
+    return sys.cpu_divider - sys.ppu_divider;
+}
+
+RomError console_init(Console& self, const mu::Str& rom_path, const RomDb* db, const mu::Str& sav_path) {
+    // the worker is stopped before its ppu goes, and started again on the new one
+    const bool threaded = self.render_worker != nullptr;
+    console_set_render_worker(self, false);
+    rom_free(self.rom);
     self = {};
 
     if (!rom_path.empty()) {
-        rom_from_ines_file(self.rom, rom_path);
+        if (auto error = rom_from_ines_file(self.rom, rom_path, db, sav_path); error != RomError::NONE) {
+            return error;
+        }
         self.assembly = bytecodes_disassemble(self.rom.prg);
     }
 
+    self.ppu = ppu_new(&self);
+    console_set_tv_system(self, rom_get_tv_system(self.rom));
+    ppu_reset(self.ppu);
+    ppu_set_mirroring(self.ppu, rom_get_mirroring(self.rom));
+    mapper_reset(self);
+    self.ppu.chr_ram = !self.rom.chr.empty() && self.rom.header.num_chrs == 0;
+
     self.cpu = cpu_new(&self);
 
     self.screen_buf = screenbuf_new(Config::resolution.w, Config::resolution.h);
+    console_set_render_worker(self, threaded);
+    return RomError::NONE;
 }
 
 void console_reset(Console& self) {
-    // ppu_reset(self.ppu);
-    cpu_reset(self.cpu);
+    // the worker's copy would miss the reset, start it again from the fresh state
+    const bool threaded = self.render_worker != nullptr;
+    console_set_render_worker(self, false);
+
     self.cycles = 0;
+    self.cpu_cycles = 0;
+    mapper_reset(self);
+    ppu_reset(self.ppu);
+    cpu_reset(self.cpu);
+    self.cpu_phase = _console_first_cpu_phase(self.ppu.tv_system);
+
+    console_set_render_worker(self, threaded);
 }
 
-void console_clock(Console& self) {
-    // ppu_clock(self.ppu);
+template <TVSystem TV>
+static void _console_clock(Console& self) {
+    constexpr auto& sys = video_system(TV);
 
-    // because ppu is 3x faster than cpu
-    if (self.cycles % 3 == 0) {
+    const auto frames = self.ppu.frames;
+    ppu_tick<TV>(self.ppu);
+    self.cycles++;
+    if (self.render_worker && self.ppu.frames != frames) {
+        render_worker_submit(*self.render_worker, !self.skip_render);
+    }
+    if (self.cycles == self.mapper.irq_at) {
+        mapper_irq_event(self);
+    }
+
+    // both are divided down from the master clock, 3 dots per cpu cycle on NTSC and Dendy, 3.2 on PAL
+    self.cpu_phase += sys.ppu_divider;
+    if (self.cpu_phase >= sys.cpu_divider) {
+        self.cpu_phase -= sys.cpu_divider;
         cpu_clock(self.cpu);
+        self.cpu_cycles++;
     }
+}
 
-    self.cycles++;
+template <TVSystem TV>
+static void _console_run_frame(Console& self) {
+    const auto frame = self.ppu.frames;
+    while (self.ppu.frames == frame) {
+        _console_clock<TV>(self);
+    }
+}
+
+void console_clock(Console& self) {
+    switch (self.ppu.tv_system) {
+    case TVSystem::NTSC: _console_clock<TVSystem::NTSC>(self); break;
+    case TVSystem::PAL: _console_clock<TVSystem::PAL>(self); break;
+    case TVSystem::DENDY: _console_clock<TVSystem::DENDY>(self); break;
+    }
+}
+
+void console_run_frame(Console& self, bool render) {
+    // cpu visible ppu state (status, sprite 0 hit) is all kept by ppu_clock,
+    // so a skipped frame only saves the rasterization
+    self.skip_render = !render;
+    switch (self.ppu.tv_system) {
+    case TVSystem::NTSC: _console_run_frame<TVSystem::NTSC>(self); break;
+    case TVSystem::PAL: _console_run_frame<TVSystem::PAL>(self); break;
+    case TVSystem::DENDY: _console_run_frame<TVSystem::DENDY>(self); break;
+    }
+    self.skip_render = false;
+}
+
+void console_set_tv_system(Console& self, TVSystem tv_system) {
+    // the worker's copy of the ppu has to follow
+    const bool threaded = self.render_worker != nullptr;
+    console_set_render_worker(self, false);
+
+    mapper_irq_sync(self);
+    self.ppu.tv_system = tv_system;
+    const auto& sys = video_system(tv_system);
+    if (self.ppu.row >= sys.scanlines_per_frame) {
+        self.ppu.row = sys.scanlines_per_frame - 1;
+        self.ppu.col = 0;
+    }
+    // dots are counted in frames of the old length up to here
+    mapper_irq_rebase(self);
+    mapper_irq_schedule(self);
+    self.cpu_phase = _console_first_cpu_phase(tv_system);
+
+    console_set_render_worker(self, threaded);
+}
+
+void console_set_render_worker(Console& self, bool enabled) {
+    if (enabled && !self.render_worker) {
+        self.render_worker = render_worker_new(self.ppu);
+    } else if (!enabled && self.render_worker) {
+        render_worker_free(self.render_worker);
+        self.render_worker = nullptr;
+    }
+}
+
+// version 3 layout, all fields are little endian as in memory
+struct SaveState {
+    mu::Arr<char, 4> magic;
+    uint32_t version;
+    uint32_t rom_crc;
+    uint32_t prg_ram_size; // bytes that follow the state
+    uint32_t chr_ram_size; // bytes that follow the prg ram
+
+    uint64_t cycles;
+    uint64_t cpu_cycles;
+    int32_t cpu_phase;
+
+    CPURegs cpu_regs;
+    uint16_t cpu_wait_cycles;
+    bool cpu_nmi_pending;
+    bool cpu_irq_line;
+
+    PPUState ppu;
+    RAM ram;
+
+    // since version 3: the mapper number, MMC1's shift register and banks, the UxROM/CNROM/AxROM bank,
+    // MMC3's bank select, R0-R7 and irq latch, counter, reload, enable, irq_at and irq_synced
+    Mapper mapper;
+    mu::Arr<uint32_t, 4> prg_banks; // offsets into rom.prg
+};
+
+static_assert(std::is_trivially_copyable_v<SaveState>);
+
+static constexpr mu::Arr<char, 4> SAVE_STATE_MAGIC {'N', 'E', 'S', 'S'};
+
+void console_save_state(const Console& self, mu::Vec<uint8_t>& out) {
+    const uint32_t prg_ram_size = self.rom.prg_ram.size();
+    const uint32_t chr_ram_size = self.ppu.chr_ram ? self.rom.chr.size() : 0;
+    out.resize(sizeof(SaveState) + prg_ram_size + chr_ram_size);
+
+    // filled in place, the buffer comes from the allocator so it is aligned for it
+    auto& state = *(SaveState*) out.data();
+    state.magic = SAVE_STATE_MAGIC;
+    state.version = SAVE_STATE_VERSION;
+    state.rom_crc = self.rom.crc;
+    state.prg_ram_size = prg_ram_size;
+    state.chr_ram_size = chr_ram_size;
+
+    state.cycles = self.cycles;
+    state.cpu_cycles = self.cpu_cycles;
+    state.cpu_phase = self.cpu_phase;
+
+    state.cpu_regs = self.cpu.regs;
+    state.cpu_wait_cycles = self.cpu.cycles;
+    state.cpu_nmi_pending = self.cpu.nmi_pending;
+    state.cpu_irq_line = self.cpu.irq_line;
+
+    ppu_save_state(self.ppu, state.ppu);
+    state.ram = self.ram;
+
+    state.mapper = self.mapper;
+    for (uint8_t slot = 0; slot < self.rom.prg_banks.size(); slot++) {
+        state.prg_banks[slot] = self.rom.prg.empty() ? 0 : uint32_t(self.rom.prg_banks[slot] - self.rom.prg.data());
+    }
+
+    uint8_t* extra = out.data() + sizeof(SaveState);
+    if (prg_ram_size) {
+        memcpy(extra, self.rom.prg_ram.data(), prg_ram_size);
+    }
+    if (chr_ram_size) {
+        memcpy(extra + prg_ram_size, self.rom.chr.data(), chr_ram_size);
+    }
+}
+
+// the rest of a state file is trusted only as far as this checks it, anything
+// used as an index or a pointer has to fit the loaded rom
+static bool _save_state_fits(const Console& self, const SaveState& state) {
+    const auto& ppu = state.ppu;
+    if (uint8_t(ppu.tv_system) > uint8_t(TVSystem::DENDY) || uint8_t(ppu.mirroring) > uint8_t(Mirroring::FOUR_SCREEN) ||
+        ppu.row >= video_system(ppu.tv_system).scanlines_per_frame || ppu.col >= 341) {
+        return false;
+    }
+    if (ppu.chr_ram != self.ppu.chr_ram || state.mapper.number != rom_get_mapper_number(self.rom)) {
+        return false;
+    }
+    for (uint32_t offset : ppu.chr_banks) {
+        if (offset != PPUCommand::UNMAPPED && uint64_t(offset) + 1024 > self.rom.chr.size()) {
+            return false;
+        }
+    }
+    for (uint32_t offset : state.prg_banks) {
+        if (!self.rom.prg.empty() && uint64_t(offset) + 8*1024 > self.rom.prg.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool console_load_state(Console& self, const uint8_t* data, size_t size) {
+    if (size < sizeof(SaveState)) {
+        mu::log_error("savestate is too small, {} bytes", size);
+        return false;
+    }
+
+    SaveState state;
+    memcpy(&state, data, sizeof(state));
+    if (state.magic != SAVE_STATE_MAGIC || state.version != SAVE_STATE_VERSION) {
+        mu::log_error("savestate is not version {}", SAVE_STATE_VERSION);
+        return false;
+    }
+    if (state.rom_crc != self.rom.crc) {
+        mu::log_error("savestate is for rom {:08x}, not the loaded {:08x}", state.rom_crc, self.rom.crc);
+        return false;
+    }
+    const uint32_t prg_ram_size = self.rom.prg_ram.size();
+    const uint32_t chr_ram_size = state.ppu.chr_ram ? self.rom.chr.size() : 0;
+    if (state.prg_ram_size != prg_ram_size || state.chr_ram_size != chr_ram_size ||
+        size != sizeof(SaveState) + prg_ram_size + chr_ram_size) {
+        mu::log_error("savestate cartridge ram doesn't match the rom");
+        return false;
+    }
+    if (!_save_state_fits(self, state)) {
+        mu::log_error("savestate is damaged, or its banks don't fit the rom");
+        return false;
+    }
+
+    // the worker's copy of the PPU would be left in the old state, start it again from the loaded one
+    const bool threaded = self.render_worker != nullptr;
+    console_set_render_worker(self, false);
+
+    self.cycles = state.cycles;
+    self.cpu_cycles = state.cpu_cycles;
+    self.cpu_phase = state.cpu_phase;
+
+    self.cpu.regs = state.cpu_regs;
+    self.cpu.cycles = state.cpu_wait_cycles;
+    self.cpu.nmi_pending = state.cpu_nmi_pending;
+    self.cpu.irq_line = state.cpu_irq_line;
+
+    const uint8_t* extra = data + sizeof(SaveState);
+    ppu_load_state(self.ppu, state.ppu, chr_ram_size ? extra + prg_ram_size : nullptr);
+    self.ram = state.ram;
+
+    self.mapper = state.mapper;
+    for (uint8_t slot = 0; slot < self.rom.prg_banks.size() && !self.rom.prg.empty(); slot++) {
+        self.rom.prg_banks[slot] = &self.rom.prg[state.prg_banks[slot]];
+    }
+    // prg ram can be the mapped .sav, rewinding to the same bytes shouldn't dirty its pages
+    if (prg_ram_size && memcmp(self.rom.prg_ram.data(), extra, prg_ram_size) != 0) {
+        memcpy(self.rom.prg_ram.data(), extra, prg_ram_size);
+    }
+    write_tracker_mark_all(self.dirty);
+
+    console_set_render_worker(self, threaded);
+    return true;
+}
+
+void console_run_ahead(Console& self, mu::Vec<uint8_t>& scratch, int frames) {
+    if (frames <= 0) {
+        console_run_frame(self);
+        console_render(self);
+        return;
+    }
+
+    // the real frame is never shown, only the one ahead of it
+    console_run_frame(self, false);
+    console_save_state(self, scratch);
+
+    // frames ahead are thrown away, so the render worker must not see them
+    auto render_worker = self.render_worker;
+    auto command_log = self.ppu.command_log;
+    self.render_worker = nullptr;
+    self.ppu.command_log = nullptr;
+
+    for (int i = 1; i < frames; i++) {
+        console_run_frame(self, false);
+    }
+    console_run_frame(self);
+    ppu_render(self.ppu, self.screen_buf);
+
+    console_load_state(self, scratch.data(), scratch.size());
+    self.render_worker = render_worker;
+    self.ppu.command_log = command_log;
+}
+
+bool console_render(Console& self) {
+    if (self.render_worker) {
+        return render_worker_present(*self.render_worker, self.screen_buf);
+    }
+    ppu_render(self.ppu, self.screen_buf);
+    return true;
 }
 
 // void console_input(Console& self, JoyPadInput joypad) {
@@ -53,9 +341,9 @@ console_get_tile_as_indices(
             }
         };
         p.bits.bit_plane = PatternTablePointer::BitPlane::LOWER;
-        auto l = std::bitset<8>(self.rom.chr[p.word]);
+        auto l = std::bitset<8>(self.ppu.chr_banks[p.word >> 10][p.word & 0x3FF]);
         p.bits.bit_plane = PatternTablePointer::BitPlane::UPPER;
-        auto h = std::bitset<8>(self.rom.chr[p.word]);
+        auto h = std::bitset<8>(self.ppu.chr_banks[p.word >> 10][p.word & 0x3FF]);
 
         for (int i = 0; i < 8; i++) {
             out[j*8+i] = h[7-i] << 1 | l[7-i];
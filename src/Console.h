@@ -2,6 +2,9 @@
 
 #include <mu/utils.h>
 
+#include <bit>
+#include <span>
+
 struct RGBAColor {
     uint8_t r, g, b, a;
 };
@@ -109,24 +112,29 @@ region_size(Region self) {
 //     mu::Vec<uint16_t> get_address(const uint16_t address) const;
 // };
 
-// enum class SpriteType : uint8_t {S8x8 = 0, S8x16 = 1};
+enum class SpriteType : uint8_t {S8x8 = 0, S8x16 = 1};
 // enum class ColorMode : uint8_t {Color = 0, Monochrome = 1};
 
-// struct SpriteInfo {
-//     uint8_t y; // Y-coordinate of the top left of the sprite minus 1
-//     uint8_t i; // Index number of the sprite in the pattern tables.
-
-//     union {
-//         struct {
-//             uint8_t color:2; // Most significant two bits of the colour
-//             uint8_t:3;
-//             uint8_t pritority:1; // Indicates whether this sprite has priority over the background
-//             uint8_t hFlip:1; // Indicates whether to flip the sprite horizontally
-//             uint8_t vFlip:1; // Indicates whether to flip the sprite vertically}
-//         } bits;
-//         uint8_t byte;
-//     } attr;
-// };
+// one OAM entry, https://www.nesdev.org/wiki/PPU_OAM
+struct SpriteInfo {
+    uint8_t y; // Y-coordinate of the top left of the sprite minus 1
+    uint8_t i; // Index number of the sprite in the pattern tables.
+
+    union {
+        struct {
+            uint8_t color:2; // Most significant two bits of the colour
+            uint8_t:3;
+            uint8_t priority:1; // 0: in front of the background, 1: behind the background
+            uint8_t hFlip:1; // Indicates whether to flip the sprite horizontally
+            uint8_t vFlip:1; // Indicates whether to flip the sprite vertically
+        } bits;
+        uint8_t byte;
+    } attr;
+
+    uint8_t x; // X-coordinate of the left side of the sprite
+};
+
+static_assert(sizeof(SpriteInfo) == 4);
 
 /*
  *  DCBA98 76543210
@@ -162,16 +170,36 @@ static_assert(sizeof(PatternTablePointer) == sizeof(uint16_t));
 
 // using MemType = mu::Arr<uint8_t, MEM_SIZE>;
 
-// Video systems info
-constexpr struct VideoSystem {
-    int cpu_cycles; // in nanoseconds
-    int fps;
-    float millis_per_frame; // in milliseconds
+enum class TVSystem : uint8_t {NTSC, PAL, DENDY};
+
+// timing of each console region, https://www.nesdev.org/wiki/Cycle_reference_chart
+struct VideoSystem {
+    double master_clock; // in Hz
+    int cpu_divider; // master clock cycles per cpu cycle
+    int ppu_divider; // master clock cycles per ppu dot
     int scanlines_per_frame;
-    float cpu_cycles_per_scanline;
-    struct {int width, height;} resolution;
-} NTSC {559, 60, 16.67f, 262, 113.33f, {256, 224}},
-PAL {601, 50, 20, 312, 106.56f, {256, 240}};
+    int vblank_scanline; // where vblank starts and NMI fires
+    bool skips_odd_dot; // odd frames are one dot shorter while rendering
+};
+
+constexpr VideoSystem
+    NTSC {21477272.0, 12, 4, 262, 241, true},
+    PAL {26601712.0, 16, 5, 312, 241, false},
+    DENDY {26601712.0, 15, 5, 312, 291, false}; // PAL clock, NTSC ratio, long post-render
+
+constexpr const VideoSystem&
+video_system(TVSystem tv_system) {
+    switch (tv_system) {
+    case TVSystem::PAL: return PAL;
+    case TVSystem::DENDY: return DENDY;
+    default: return NTSC;
+    }
+}
+
+constexpr double
+video_system_fps(const VideoSystem& self) {
+    return self.master_clock / self.ppu_divider / (341.0 * self.scanlines_per_frame);
+}
 
 // memory regions
 constexpr Region
@@ -181,6 +209,7 @@ constexpr Region
     RAM_REGION {0x0000, 0x1FFF}, // all ram, including mirrored parts
 
     IO_REGS0 {0x2000, 0x2008-1},
+    IO_REGS0_REGION {0x2000, 0x4000-1}, // io regs0, including mirrored parts
     IO_REGS1 {0x4000, 0x4020-1},
 
     EX_ROM {0x4020, 0x6000-1},
@@ -262,10 +291,8 @@ constexpr uint16_t PPU_CTRL_REG0 = 0x2000,
                 APU_VERTICAL_CLOCK_SIGNAL_REG         = 0x4015;
 
 namespace Config {
-    constexpr VideoSystem sys = PAL;
-
     struct Rect {int w, h;};
-    constexpr Rect resolution{sys.resolution.width, sys.resolution.height};
+    constexpr Rect resolution{256, 240};
 
     constexpr Rect window{resolution.w * 3, resolution.h * 3};
 
@@ -315,11 +342,16 @@ struct CPU {
     AddressMode mode;
 
     bool cross_page_penalty;
+
+    bool nmi_pending; // serviced before the next instruction
+    bool irq_line; // held by the cartridge until acknowledged, serviced while i is clear
 };
 
 CPU cpu_new(Console* console);
 void cpu_reset(CPU& self);
 void cpu_clock(CPU& self);
+void cpu_nmi(CPU& self);
+void cpu_irq(CPU& self);
 
 uint8_t cpu_read(CPU& self, uint16_t address);
 uint16_t cpu_read16(CPU& self, uint16_t address);
@@ -343,6 +375,7 @@ struct Instruction {
     AddressMode mode;
     uint16_t cycles;
     bool cross_page_penalty;
+    bool writes_only = false; // stores, the operand isn't read first, reading $2007 would move the vram address
 };
 
 using InstructionSet = mu::Arr<Instruction, 0xFF+1>;
@@ -354,7 +387,7 @@ struct Assembly {
 };
 
 mu::Vec<Assembly>
-bytecodes_disassemble(const mu::Vec<uint8_t>& bytecodes, mu::memory::Allocator* allocator = mu::memory::default_allocator());
+bytecodes_disassemble(std::span<const uint8_t> bytecodes, mu::memory::Allocator* allocator = mu::memory::default_allocator());
 
 struct ScreenBuf {
     size_t w, h;
@@ -376,27 +409,211 @@ screenbuf_put(ScreenBuf& self, size_t xw, size_t yh, RGBAColor color) {
     self.pixels.at(xw + yh * self.w) = color;
 }
 
+// cheap hash of the pixels, only to tell whether a frame differs from the last one
+inline static uint64_t
+screenbuf_hash(const ScreenBuf& self) {
+    const uint8_t* bytes = (const uint8_t*) self.pixels.data();
+    const size_t size = self.pixels.size() * sizeof(RGBAColor);
+
+    uint64_t h = 0xCBF29CE484222325;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        h = std::rotl((h ^ word) * 0x100000001B3, 29);
+    }
+    for (; i < size; i++) {
+        h = (h ^ bytes[i]) * 0x100000001B3;
+    }
+    return h;
+}
+
 struct Palette {
     uint8_t index[4];
 };
 
+// all 4 nametables side by side (2x2), in pixels and in tiles
+constexpr int BG_PLANE_W = 2 * 256, BG_PLANE_H = 2 * 240;
+constexpr int BG_PLANE_TILES_W = BG_PLANE_W / 8, BG_PLANE_TILES_H = BG_PLANE_H / 8;
+
+// pre-rendered background plane, so a frame only re-rasterizes the tiles
+// that changed since the last one and then copies the visible window
+struct BgCache {
+    // each pixel is palette<<2 | color, color 0 is transparent
+    mu::Vec<uint8_t> plane;
+
+    // one word per row of tiles in the plane, one bit per tile
+    mu::Arr<uint64_t, BG_PLANE_TILES_H> dirty_tiles;
+
+    // one bit per tile in the pattern tables (2 * 256 tiles)
+    mu::Arr<uint64_t, 512 / 64> dirty_chr;
+
+    // pattern table the plane was rasterized from
+    uint8_t pattern_table;
+};
+
+// how the 4 nametables map to physical 1 KB pages
+enum class Mirroring : uint8_t {
+    HORIZONTAL, // $2000 = $2400, $2800 = $2C00
+    VERTICAL, // $2000 = $2800, $2400 = $2C00
+    SINGLE_LOWER, // all the 4 are the first page
+    SINGLE_UPPER, // all the 4 are the second page
+    FOUR_SCREEN, // cartridge provides the other 2 pages
+};
+
+// scroll position of one scanline inside the background plane
+struct ScanlineScroll {
+    uint16_t x, y;
+};
+
+// one bit per pixel of a scanline, bit 0 of the first word is the leftmost pixel
+using Mask256 = mu::Arr<uint64_t, 4>;
+
+// result of evaluating OAM for one scanline
+struct ScanlineSprites {
+    uint8_t count;
+    uint8_t index[8]; // into oam, in priority order
+    bool overflow; // more than 8 sprites are on this scanline
+    uint8_t sprite0; // opaque pixels of sprite 0, bit 0 is its leftmost pixel
+    Mask256 coverage; // opaque pixels of all the sprites
+    Mask256 behind; // pixels where the front-most sprite is behind the background
+};
+
+// a PPU access recorded for the render worker, stamped with the dot it happened at
+struct PPUCommand {
+    enum class Kind : uint8_t {
+        WRITE, // register write
+        READ, // register read, $2002 and $2007 reads change the internal registers
+        MIRRORING, // data is the Mirroring
+        MAP_CHR, // data is the slot, chr_offset is where the bank starts in rom.chr
+    };
+
+    static constexpr uint32_t UNMAPPED = UINT32_MAX;
+
+    Kind kind;
+    uint8_t data;
+    uint16_t addr;
+    uint16_t row, col;
+    uint32_t chr_offset;
+};
+
 struct PPU {
     Console* console;
-    uint16_t cycles, row, col;
+    TVSystem tv_system;
+    uint16_t row, col; // scanline, dot
+    uint64_t frames; // completed frames, counted at start of vblank
+
+    // $2000
+    union {
+        struct {
+            uint8_t nametable:2; // base nametable
+            uint8_t increment:1; // vram address increment per $2007 access, 0: 1, 1: 32
+            uint8_t sprite_table:1; // sprite pattern table for 8x8 sprites
+            uint8_t bg_table:1; // background pattern table
+            SpriteType sprite_size:1;
+            uint8_t master_slave:1;
+            uint8_t nmi:1; // generate NMI at start of vblank
+        } bits;
+        uint8_t byte;
+    } ctrl;
+
+    // $2001
+    union {
+        struct {
+            uint8_t grayscale:1;
+            uint8_t show_bg_left:1; // show background in leftmost 8 pixels
+            uint8_t show_sprites_left:1; // show sprites in leftmost 8 pixels
+            uint8_t show_bg:1;
+            uint8_t show_sprites:1;
+            uint8_t emphasize:3; // red, green, blue
+        } bits;
+        uint8_t byte;
+    } mask;
+
+    // $2002
+    union {
+        struct {
+            uint8_t:5;
+            uint8_t sprite_overflow:1;
+            uint8_t sprite0_hit:1;
+            uint8_t vblank:1;
+        } bits;
+        uint8_t byte;
+    } status;
+
+    // internal registers, https://www.nesdev.org/wiki/PPU_scrolling
+    uint16_t v; // current vram address
+    uint16_t t; // temporary vram address, top left onscreen tile
+    uint8_t fine_x;
+    bool write_toggle;
+    uint8_t read_buffer; // $2007 reads are delayed by one
 
     // vram
     uint8_t universal_bg_index; // $3F00
     Palette bg_palettes[4],      // $3F01 - $3F0F
             sprite_palettes[4];  // $3F11 - $3F1F
 
-    mu::Arr<uint8_t, region_size(NAME_TBL0)> nametable;
+    mu::Arr<uint8_t, 4 * 1024> ciram; // 2 KB in the console, last 2 KB only used for four-screen
+
+    // ppu address space in 1 KB pages, so a fetch is one shift, one index and one load
+    // nametables point into ciram, so call ppu_set_mirroring again after moving the PPU
+    Mirroring mirroring;
+    mu::Arr<uint8_t*, 4> nametables; // $2000-$2FFF
+    mu::Arr<uint8_t*, 8> chr_banks; // $0000-$1FFF
+    bool chr_ram; // chr banks are writable
+
+    uint8_t oam_addr; // $2003
+    mu::Arr<SpriteInfo, 64> oam;
+
+    mu::Arr<ScanlineScroll, 240> scanline_scroll;
+    mu::Arr<ScanlineSprites, 240> scanline_sprites; // evaluated once per frame
+    uint16_t sprite0_hit_dot; // dot of current scanline where sprite 0 hits, 0 if it doesn't
+    BgCache bg;
+
+    mu::Vec<PPUCommand>* command_log; // when set, accesses are recorded for the render worker
 };
 
-// void ppu_clock(PPU& self);
-// void ppu_reset(PPU& self);
-// bool ppu_read(PPU& self, uint16_t addr, uint8_t& data);
-// bool ppu_write(PPU& self, uint16_t addr, uint8_t data);
-void ppu_render(const PPU& self, ScreenBuf& buf);
+static_assert(sizeof(PPU::ctrl) == sizeof(uint8_t));
+static_assert(sizeof(PPU::mask) == sizeof(uint8_t));
+static_assert(sizeof(PPU::status) == sizeof(uint8_t));
+
+// what a savestate keeps of the PPU, in a fixed layout without pointers
+// sprite evaluation and the background cache are rebuilt from it on load
+struct PPUState {
+    uint64_t frames;
+    uint16_t row, col;
+    uint16_t v, t;
+    uint16_t sprite0_hit_dot;
+    uint8_t ctrl, mask, status;
+    uint8_t fine_x;
+    bool write_toggle;
+    uint8_t read_buffer;
+    uint8_t oam_addr;
+    TVSystem tv_system;
+    Mirroring mirroring;
+    bool chr_ram;
+    uint8_t universal_bg_index;
+    Palette bg_palettes[4], sprite_palettes[4];
+    mu::Arr<uint32_t, 8> chr_banks; // offsets into rom.chr, PPUCommand::UNMAPPED if not in it
+    mu::Arr<uint8_t, 4 * 1024> ciram;
+    mu::Arr<SpriteInfo, 64> oam;
+    mu::Arr<ScanlineScroll, 240> scanline_scroll;
+};
+
+PPU ppu_new(Console* console);
+void ppu_reset(PPU& self);
+void ppu_clock(PPU& self);
+template <TVSystem TV> void ppu_tick(PPU& self); // ppu_clock with the region known at compile time
+bool ppu_read(PPU& self, uint16_t addr, uint8_t& data);
+bool ppu_write(PPU& self, uint16_t addr, uint8_t data);
+void ppu_render(PPU& self, ScreenBuf& buf);
+void ppu_render_scanline(PPU& self, size_t y, ScreenBuf& buf); // with the state as it is now
+void ppu_set_mirroring(PPU& self, Mirroring mirroring);
+void ppu_map_chr(PPU& self, uint8_t slot, uint8_t* bank); // map 1 KB bank at slot * $0400
+void ppu_save_state(const PPU& self, PPUState& state);
+// chr_ram is the saved content of rom.chr when it is writable, copied back into it
+// only the cached background tiles whose nametable entry or pattern changed are redrawn
+void ppu_load_state(PPU& self, const PPUState& state, const uint8_t* chr_ram);
 
 using RAM = mu::Arr<uint8_t, 0x07FF+1>;
 
@@ -444,42 +661,379 @@ struct INESFileHeader {
         uint8_t byte;
     } flags7;
 
-    // Flags 8, 9 and 10 are not supported
-    uint8_t _padding[8];
+    uint8_t _padding8;
+
+    // iNES: bit 0 is the TV system, 0: NTSC, 1: PAL
+    uint8_t flags9;
+
+    uint8_t _padding10[2];
+
+    // NES 2.0: bits 0-1 are the CPU/PPU timing, 0: NTSC, 1: PAL, 2: multiple regions, 3: Dendy
+    uint8_t timing;
+
+    uint8_t _padding13[3];
 };
 
 static_assert(sizeof(INESFileHeader) == 16);
 
+// a read-only file mapped copy-on-write, writes stay private to the mapping
+struct MappedFile {
+    uint8_t* data;
+    size_t size;
+};
+
+bool mapped_file_open(MappedFile& self, const char* path);
+// read-write and shared with the file, which is created or grown to size
+bool mapped_file_open_shared(MappedFile& self, const char* path, size_t size);
+void mapped_file_flush(MappedFile& self); // starts writing dirty pages back, doesn't wait for them
+void mapped_file_close(MappedFile& self);
+
 struct ROM {
     INESFileHeader header;
-    mu::Vec<uint8_t> prg; // program: instructions
-    mu::Vec<uint8_t> chr; // characters: sprites/graphics
+    std::span<uint8_t> prg; // program: instructions
+    std::span<uint8_t> chr; // characters: sprites/graphics, 8 KB of RAM in chr_buf when the file has none
+
+    // prg and chr point into the mapped .nes file, so loading copies nothing and every
+    // instance of the same rom shares its pages, or into the owned buffers when not from a file
+    MappedFile file;
+    mu::Vec<uint8_t> image; // the .nes file inflated from a zip, or grown by a patch
+    mu::Vec<uint8_t> prg_buf, chr_buf;
+
+    std::span<uint8_t> prg_ram; // $6000-$7FFF, empty if the cartridge has none
+    mu::Vec<uint8_t> prg_ram_buf;
+    MappedFile sav; // battery backed prg_ram is mapped from the .sav next to the rom, guest writes are file writes
+    uint32_t crc; // of prg and chr rom, savestates refer to the ROM by it
+
+    // $8000-$FFFF in 8 KB banks, pointed into prg by the mapper
+    // so a read is one shift, one index and one load whatever the mapper is
+    mu::Arr<const uint8_t*, 4> prg_banks;
+};
+
+struct RomDb;
+
+// the biggest rom file accepted, sizes read from zips and patches are checked against it before allocating
+constexpr size_t ROM_MAX_SIZE = 64*1024*1024;
+
+// why a rom didn't load, the details are logged
+enum class RomError : uint8_t {
+    NONE,
+    UNREADABLE, // missing, or can't be mapped
+    BAD_HEADER, // not an iNES file
+    TRUNCATED, // shorter than the header says
+    UNSUPPORTED_MAPPER,
+    NO_PRG,
+    BAD_ZIP, // no .nes in it, corrupt, or compressed with something other than deflate
+    BAD_PATCH, // the .ips or .bps next to it is corrupt or for another rom
 };
 
-void rom_from_ines_file(ROM& self, const mu::Str& ines_path);
+const char* rom_error_str(RomError error);
+
+// a header the database knows better is corrected in place, a .zip loads its first .nes,
+// and a .ips or .bps with the same name as the rom is applied to it, on error the rom is left empty,
+// battery ram is mapped from sav_path, or kept in memory if it's empty so instances don't share it
+RomError rom_from_ines_file(ROM& self, const mu::Str& ines_path, const RomDb* db = nullptr, const mu::Str& sav_path = "");
+// header, prg and chr pointing into data, and the crc
+RomError rom_parse_ines(ROM& self, uint8_t* data, size_t size, const RomDb* db = nullptr);
+void rom_free(ROM& self);
+void rom_set_prg(ROM& self, mu::Vec<uint8_t> prg); // owned by the rom instead of the file
+void rom_set_chr(ROM& self, mu::Vec<uint8_t> chr);
+// prg_ram if the mapper has it, mapped from sav_path if it's battery backed and sav_path isn't empty
+void rom_alloc_prg_ram(ROM& self, const mu::Str& sav_path = "");
+mu::Str rom_sav_path(const mu::Str& ines_path); // the .sav next to the rom
+void rom_flush_sav(ROM& self); // hands battery ram to the os to write out, without waiting
 
 inline uint16_t rom_get_mapper_number(const ROM& self) {
-    return self.header.flags6.bits.lower_mapper_num | self.header.flags7.bits.upper_mapper_num << 8;
+    return self.header.flags6.bits.lower_mapper_num | self.header.flags7.bits.upper_mapper_num << 4;
+}
+
+inline Mirroring rom_get_mirroring(const ROM& self) {
+    if (self.header.flags6.bits.ignore_mirroring_control) {
+        return Mirroring::FOUR_SCREEN;
+    }
+    return self.header.flags6.bits.mirroring ? Mirroring::VERTICAL : Mirroring::HORIZONTAL;
+}
+
+inline TVSystem rom_get_tv_system(const ROM& self) {
+    const auto& header = self.header;
+    if (header.flags7.bits.nes2format == 2) {
+        constexpr TVSystem TIMINGS[] = {TVSystem::NTSC, TVSystem::PAL, TVSystem::NTSC, TVSystem::DENDY};
+        return TIMINGS[header.timing & 0b11];
+    }
+
+    // old dumpers wrote their name over bytes 7-15, byte 9 can't be trusted then
+    const bool dirty = header.timing != 0 || header._padding13[0] != 0 || header._padding13[1] != 0 || header._padding13[2] != 0;
+    return !dirty && (header.flags9 & 1) ? TVSystem::PAL : TVSystem::NTSC;
 }
 
+// zlib's crc32, pass the last result as crc to continue it over more data
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0);
+
+using SHA1Digest = mu::Arr<uint8_t, 20>;
+
+struct SHA1 {
+    mu::Arr<uint32_t, 5> h;
+    uint64_t size; // bytes so far
+    mu::Arr<uint8_t, 64> block; // the last partial block
+};
+
+SHA1 sha1_new();
+void sha1_update(SHA1& self, const uint8_t* data, size_t size);
+SHA1Digest sha1_final(SHA1& self);
+
+// deflate, into exactly out_size bytes, false on corrupt or short data
+bool inflate(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size);
+
+struct ZipMember {
+    uint8_t* data; // points into the zip
+    size_t compressed_size, size;
+    uint16_t method; // 0: stored, 8: deflated
+    uint32_t crc; // of the uncompressed data
+};
+
+bool zip_is(const uint8_t* data, size_t size);
+bool zip_find(uint8_t* zip, size_t size, mu::StrView ext, ZipMember& member); // first member ending in ext
+
+// ips patches in place, the target holds the source grown or cut to target_size first
+bool ips_target_size(const uint8_t* patch, size_t patch_size, size_t source_size, size_t& target_size);
+bool ips_apply(const uint8_t* patch, size_t patch_size, uint8_t* target, size_t target_size);
+// bps builds the target from the source, false if any of its crc32s don't match,
+// or the target would be bigger than ROM_MAX_SIZE
+bool bps_target_size(const uint8_t* patch, size_t patch_size, size_t& target_size);
+bool bps_apply(const uint8_t* patch, size_t patch_size, const uint8_t* source, size_t source_size, uint8_t* target, size_t target_size);
+
+// what the header of a good dump says, keyed by the crc32 of its prg and chr
+struct RomDbEntry {
+    uint32_t crc;
+    SHA1Digest sha1; // tells apart roms with the same crc
+    uint16_t mapper;
+    Mirroring mirroring;
+    TVSystem tv_system;
+    bool battery;
+    uint8_t _padding[3];
+};
+
+static_assert(sizeof(RomDbEntry) == 32);
+
+// the database file mapped as is, lookups are a binary search over it with nothing parsed at startup
+struct RomDb {
+    MappedFile file;
+    std::span<const RomDbEntry> entries; // sorted by crc, then sha1
+};
+
+bool romdb_open(RomDb& self, const char* path);
+void romdb_close(RomDb& self);
+// nullptr if it isn't known, sha1 is rom_sha1(rom) if the caller already has it, else it's hashed on a crc match
+const RomDbEntry* romdb_find(const RomDb& self, const ROM& rom, const SHA1Digest* sha1 = nullptr);
+SHA1Digest rom_sha1(const ROM& rom); // of prg and chr
+bool romdb_write(const char* path, mu::Vec<RomDbEntry>& entries); // sorts entries
+// lines of crc32,sha1,mapper,h|v|4,battery,ntsc|pal|dendy, '#' starts a comment
+bool romdb_from_csv(const char* csv_path, const char* out_path);
+void rom_apply_db_entry(ROM& self, const RomDbEntry& entry); // mapper, mirroring, battery and region
+
+// one .nes file of a library
+struct RomIndexEntry {
+    int64_t mtime;
+    uint64_t file_size;
+    uint32_t path_offset, path_size; // into RomIndex::paths, relative to the scanned directory
+    uint32_t crc;
+    SHA1Digest sha1;
+    uint32_t prg_size, chr_size;
+    uint16_t mapper;
+    TVSystem tv_system;
+    bool valid; // an iNES file, only mtime and file_size mean anything otherwise
+    uint8_t _padding[4];
+};
+
+static_assert(sizeof(RomIndexEntry) == 64);
+
+struct RomIndex {
+    mu::Vec<RomIndexEntry> entries;
+    mu::Vec<char> paths;
+};
+
+constexpr const char* ROM_INDEX_FILE = ".nesemu-index"; // in the scanned directory
+
+// walks dir for .nes files and hashes them on `threads` threads, files with the same mtime and
+// size as in self are taken from it instead, returns how many were hashed
+size_t rom_index_scan(RomIndex& self, const char* dir, const RomDb* db, int threads);
+bool rom_index_load(RomIndex& self, const char* path);
+bool rom_index_save(const RomIndex& self, const char* path);
+
 bool rom_read(ROM& self, uint16_t addr, uint8_t& data);
 bool rom_write(ROM& self, uint16_t addr, uint8_t data);
 
+// cartridge registers, one flat struct for all the mappers so savestates copy it as is
+struct Mapper {
+    uint16_t number;
+
+    // MMC1, written one bit at a time through a shift register
+    uint8_t shift, shift_count;
+    uint8_t control, chr_bank0, chr_bank1, prg_bank;
+
+    // UxROM, CNROM and AxROM, their only register
+    uint8_t bank;
+
+    // MMC3
+    uint8_t bank_select;
+    mu::Arr<uint8_t, 8> banks; // R0-R7
+    uint8_t irq_latch, irq_counter;
+    bool irq_reload, irq_enabled;
+    uint64_t irq_at; // console.cycles when the counter raises the irq, UINT64_MAX if it won't
+    uint64_t irq_synced; // ppu dot the counter was last caught up to, counted from power on
+};
+
+bool mapper_supported(uint16_t number); // NROM, MMC1, UxROM, CNROM, AxROM and MMC3
+bool mapper_has_prg_ram(const ROM& rom); // 8 KB at $6000
+void mapper_reset(Console& self); // power-on banks, from the rom's mapper number
+bool mapper_write(Console& self, uint16_t addr, uint8_t data); // $8000-$FFFF
+
+// MMC3 scanline counter, counted lazily from the ppu position instead of per dot
+void mapper_irq_sync(Console& self); // catch the counter up, before $2000/$2001 change
+void mapper_irq_schedule(Console& self); // recompute mapper.irq_at, after they changed
+void mapper_irq_rebase(Console& self); // after the frame length changed, once synced
+void mapper_irq_event(Console& self); // at mapper.irq_at
+
+// rasterizes frame N on another thread while the console runs frame N+1,
+// by replaying the PPU accesses of frame N on its own copy of the PPU
+struct RenderWorker;
+
+RenderWorker* render_worker_new(PPU& ppu); // ppu starts recording into the worker
+void render_worker_free(RenderWorker* self);
+// hand over the recorded frame, blocks if the last one isn't done yet
+// without render, the worker only replays it to stay in step
+void render_worker_submit(RenderWorker& self, bool render);
+bool render_worker_present(RenderWorker& self, ScreenBuf& buf); // false if no new frame is done since the last call
+
+#ifndef NESEMU_WRITE_TRACKING
+#define NESEMU_WRITE_TRACKING 0
+#endif
+
+// with NESEMU_WRITE_TRACKING, every write sets the bit of the 64-byte block it lands in, so
+// savestates, hashing, rewind and the debugger can skip what didn't change since the last clear
+// without it nothing is marked, and every mark compiles to nothing
+constexpr bool WRITE_TRACKING = NESEMU_WRITE_TRACKING;
+constexpr size_t DIRTY_BLOCK = 64;
+
+// one bit per DIRTY_BLOCK bytes of a SIZE bytes memory
+template <size_t SIZE>
+struct DirtyBitmap {
+    static constexpr size_t BLOCKS = (SIZE + DIRTY_BLOCK - 1) / DIRTY_BLOCK;
+    mu::Arr<uint64_t, (BLOCKS + 63) / 64> words;
+};
+
+template <size_t SIZE>
+inline void dirty_bitmap_mark(DirtyBitmap<SIZE>& self, size_t offset) {
+    if constexpr (WRITE_TRACKING) {
+        const size_t block = offset / DIRTY_BLOCK;
+        self.words[block / 64] |= uint64_t(1) << (block % 64);
+    }
+}
+
+template <size_t SIZE>
+inline void dirty_bitmap_mark_all(DirtyBitmap<SIZE>& self) {
+    if constexpr (WRITE_TRACKING) {
+        for (size_t block = 0; block < self.BLOCKS; block++) {
+            self.words[block / 64] |= uint64_t(1) << (block % 64);
+        }
+    }
+}
+
+template <size_t SIZE>
+inline bool dirty_bitmap_test(const DirtyBitmap<SIZE>& self, size_t block) {
+    return self.words[block / 64] & (uint64_t(1) << (block % 64));
+}
+
+// memories the cpu and ppu write to, cleared only by whoever reads them
+struct WriteTracker {
+    DirtyBitmap<sizeof(RAM)> ram;
+    DirtyBitmap<8 * 1024> prg_ram;
+    DirtyBitmap<4 * 1024> ciram;
+    DirtyBitmap<64 * sizeof(SpriteInfo)> oam;
+};
+
+inline void write_tracker_clear(WriteTracker& self) {
+    self = {};
+}
+
+inline void write_tracker_mark_all(WriteTracker& self) {
+    dirty_bitmap_mark_all(self.ram);
+    dirty_bitmap_mark_all(self.prg_ram);
+    dirty_bitmap_mark_all(self.ciram);
+    dirty_bitmap_mark_all(self.oam);
+}
+
 struct Console {
-    uint64_t cycles;
+    uint64_t cycles; // ppu dots
+    uint64_t cpu_cycles;
+    int cpu_phase; // master clock cycles since the last cpu cycle
 
     CPU cpu;
     PPU ppu;
     RAM ram;
     ROM rom;
+    Mapper mapper;
 
     ScreenBuf screen_buf;
     mu::Vec<Assembly> assembly;
+
+    RenderWorker* render_worker; // null when rendering on the emulation thread
+    bool skip_render; // frames finished while set are emulated but never rasterized
+
+    WriteTracker dirty; // only marked with WRITE_TRACKING
 };
 
-void console_init(Console& self, const mu::Str& rom_path = "");
+// a rom that fails to load leaves the console empty, with the error, otherwise
+// a render worker that was attached is started again on the new console
+RomError console_init(Console& self, const mu::Str& rom_path = "", const RomDb* db = nullptr, const mu::Str& sav_path = "");
 void console_reset(Console& self);
 void console_clock(Console& self);
+void console_run_frame(Console& self, bool render = true); // until the ppu finishes the current frame
+void console_set_render_worker(Console& self, bool enabled);
+void console_set_tv_system(Console& self, TVSystem tv_system); // the ROM's region is set on init
+
+// savestates are a fixed layout blob: header, cpu, ppu, ram, mapper, then the cartridge's prg and chr ram
+// the ROM itself is only referred to by its crc, so a state is 7.5 KB (8 KB more for each cartridge ram)
+constexpr uint32_t SAVE_STATE_VERSION = 3;
+
+// out is resized and reused, so saving every frame into the same buffer doesn't allocate
+void console_save_state(const Console& self, mu::Vec<uint8_t>& out);
+// false if the state is from another version, another ROM or is cut short, the console is untouched then
+bool console_load_state(Console& self, const uint8_t* data, size_t size);
+
+// run the current frame, then rasterize how the game looks `frames` frames later
+// with the same input, and go back to right after the current frame
+void console_run_ahead(Console& self, mu::Vec<uint8_t>& scratch, int frames);
+bool console_render(Console& self); // into screen_buf, false if the worker has no new frame yet
+
+// rewind history, a savestate every frame in a fixed size ring of bytes
+// each is kept as its xor against the last keyframe, which is mostly zeros,
+// packed as runs of zeros and literals, so a frame takes a few hundred bytes
+struct RewindFrame {
+    size_t offset; // in the ring
+    uint32_t size; // packed
+    uint32_t state_size; // unpacked
+    bool keyframe; // packed on its own, not against the last keyframe
+};
+
+struct Rewind {
+    mu::Vec<uint8_t> ring;
+    size_t head; // where the next frame goes
+
+    // oldest first, starting at frames[first]
+    mu::Vec<RewindFrame> frames;
+    size_t first, count;
+
+    int keyframe_interval; // in frames
+    int since_keyframe;
+    mu::Vec<uint8_t> keyframe; // the newest one, unpacked
+
+    mu::Vec<uint8_t> state, packed; // reused between frames
+};
+
+Rewind rewind_new(size_t bytes, size_t max_frames, int keyframe_interval = 60);
+void rewind_clear(Rewind& self);
+void rewind_push(Rewind& self, const Console& console); // after every frame, oldest frames are dropped when full
+bool rewind_pop(Rewind& self, Console& console); // load the newest frame and drop it, false if there is none
 
 // struct JoyPadInput {
 //     bool a;
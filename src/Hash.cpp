@@ -0,0 +1,222 @@
+#include "Console.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #include <immintrin.h>
+    #define CRC32_PCLMUL 1
+#elif defined(__ARM_FEATURE_CRC32)
+    #include <arm_acle.h>
+#endif
+
+// https://en.wikipedia.org/wiki/Cyclic_redundancy_check, the zlib polynomial (reversed)
+static constexpr uint32_t CRC32_POLY = 0xEDB88320;
+
+// slicing-by-8, table[k][b] is the crc of byte b followed by k zero bytes
+static constexpr auto _crc32_tables = [] {
+    mu::Arr<mu::Arr<uint32_t, 256>, 8> tables {};
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32_POLY : 0);
+        }
+        tables[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (uint32_t b = 0; b < 256; b++) {
+            tables[k][b] = (tables[k-1][b] >> 8) ^ tables[0][tables[k-1][b] & 0xFF];
+        }
+    }
+    return tables;
+}();
+
+#ifdef CRC32_PCLMUL
+static __m128i _load(const uint8_t* p) {
+    return _mm_loadu_si128((const __m128i*) p);
+}
+
+// x * k folds x 128 or 512 bits ahead, onto next
+__attribute__((target("pclmul,sse4.1")))
+static __m128i _fold(__m128i x, __m128i k, __m128i next) {
+    const __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+    const __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(hi, lo), next);
+}
+
+// folds 64 bytes at a time with carry-less multiplies, then a barrett reduction,
+// "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ", Intel 2009.
+// size is at least 64 and a multiple of 16, crc isn't inverted
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t _crc32_pclmul(const uint8_t* data, size_t size, uint32_t crc) {
+    alignas(16) static constexpr uint64_t K1K2[2] = {0x0154442bd4, 0x01c6e41596};
+    alignas(16) static constexpr uint64_t K3K4[2] = {0x01751997d0, 0x00ccaa009e};
+    alignas(16) static constexpr uint64_t K5K0[2] = {0x0163cd6124, 0x0000000000};
+    alignas(16) static constexpr uint64_t POLY[2] = {0x01db710641, 0x01f7011641};
+
+    __m128i x1 = _mm_xor_si128(_load(data), _mm_cvtsi32_si128(crc));
+    __m128i x2 = _load(data + 16), x3 = _load(data + 32), x4 = _load(data + 48);
+    data += 64;
+    size -= 64;
+
+    // 4 lanes of 128 bits
+    __m128i k = _mm_load_si128((const __m128i*) K1K2);
+    for (; size >= 64; data += 64, size -= 64) {
+        x1 = _fold(x1, k, _load(data));
+        x2 = _fold(x2, k, _load(data + 16));
+        x3 = _fold(x3, k, _load(data + 32));
+        x4 = _fold(x4, k, _load(data + 48));
+    }
+
+    // into 1 lane, then the rest 16 bytes at a time
+    k = _mm_load_si128((const __m128i*) K3K4);
+    x1 = _fold(x1, k, x2);
+    x1 = _fold(x1, k, x3);
+    x1 = _fold(x1, k, x4);
+    for (; size >= 16; data += 16, size -= 16) {
+        x1 = _fold(x1, k, _load(data));
+    }
+
+    // 128 to 64 bits
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    k = _mm_loadl_epi64((const __m128i*) K5K0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // barrett reduction to 32 bits
+    k = _mm_load_si128((const __m128i*) POLY);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+static const bool _crc32_has_pclmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc) {
+    const auto& t = _crc32_tables;
+    crc = ~crc;
+
+#if defined(CRC32_PCLMUL)
+    if (_crc32_has_pclmul && size >= 64) {
+        const size_t chunk = size & ~size_t(15);
+        crc = _crc32_pclmul(data, chunk, crc);
+        data += chunk;
+        size -= chunk;
+    }
+#elif defined(__ARM_FEATURE_CRC32)
+    // armv8's crc32 instructions use the same polynomial
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t v;
+        memcpy(&v, data, 8);
+        crc = __crc32d(crc, v);
+    }
+#endif
+
+    // 8 bytes per step, little endian loads
+    for (; size >= 8; size -= 8, data += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, data, 4);
+        memcpy(&hi, data + 4, 4);
+        lo ^= crc;
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    for (; size > 0; size--, data++) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xFF];
+    }
+
+    return ~crc;
+}
+
+// https://en.wikipedia.org/wiki/SHA-1
+static void _sha1_block(SHA1& self, const uint8_t* block) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = uint32_t(block[i*4]) << 24 | uint32_t(block[i*4 + 1]) << 16 | uint32_t(block[i*4 + 2]) << 8 | block[i*4 + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = std::rotl(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+    }
+
+    uint32_t a = self.h[0], b = self.h[1], c = self.h[2], d = self.h[3], e = self.h[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        const uint32_t t = std::rotl(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = std::rotl(b, 30);
+        b = a;
+        a = t;
+    }
+
+    self.h[0] += a;
+    self.h[1] += b;
+    self.h[2] += c;
+    self.h[3] += d;
+    self.h[4] += e;
+}
+
+SHA1 sha1_new() {
+    return SHA1 {
+        .h = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0},
+    };
+}
+
+void sha1_update(SHA1& self, const uint8_t* data, size_t size) {
+    size_t buffered = self.size % 64;
+    self.size += size;
+
+    if (buffered > 0) {
+        const size_t n = std::min(size, 64 - buffered);
+        memcpy(&self.block[buffered], data, n);
+        data += n;
+        size -= n;
+        if (buffered + n < 64) {
+            return;
+        }
+        _sha1_block(self, self.block.data());
+    }
+
+    for (; size >= 64; data += 64, size -= 64) {
+        _sha1_block(self, data);
+    }
+    memcpy(self.block.data(), data, size);
+}
+
+SHA1Digest sha1_final(SHA1& self) {
+    // 0x80, zeros up to 56 mod 64, then the size in bits big endian
+    const uint64_t bits = self.size * 8;
+    const uint8_t pad = 0x80, zero = 0;
+    sha1_update(self, &pad, 1);
+    while (self.size % 64 != 56) {
+        sha1_update(self, &zero, 1);
+    }
+    uint8_t size_be[8];
+    for (int i = 0; i < 8; i++) {
+        size_be[i] = uint8_t(bits >> (56 - i*8));
+    }
+    sha1_update(self, size_be, 8);
+
+    SHA1Digest digest;
+    for (int i = 0; i < 20; i++) {
+        digest[i] = uint8_t(self.h[i / 4] >> (24 - i % 4 * 8));
+    }
+    return digest;
+}
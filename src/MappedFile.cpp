@@ -0,0 +1,138 @@
+#include "Console.h"
+
+#ifdef OS_WINDOWS
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// pages are mapped copy-on-write: shared with every other mapping of the file until written,
+// then the writer gets its own copy and the file never changes
+bool mapped_file_open(MappedFile& self, const char* path) {
+    self = {};
+
+#ifdef OS_WINDOWS
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    mu_defer(CloseHandle(file));
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        return false;
+    }
+    if (size.QuadPart == 0) {
+        return true;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    if (mapping == nullptr) {
+        return false;
+    }
+    mu_defer(CloseHandle(mapping)); // the view keeps it alive
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    if (data == nullptr) {
+        return false;
+    }
+    self.data = (uint8_t*) data;
+    self.size = size.QuadPart;
+#else
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    mu_defer(close(fd));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+    if (st.st_size == 0) {
+        return true;
+    }
+
+    void* data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    self.data = (uint8_t*) data;
+    self.size = st.st_size;
+#endif
+
+    return true;
+}
+
+// shared with the file instead: writes land in the page cache and reach the file even if the process dies
+bool mapped_file_open_shared(MappedFile& self, const char* path, size_t size) {
+    self = {};
+    if (size == 0) {
+        return false;
+    }
+
+#ifdef OS_WINDOWS
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    mu_defer(CloseHandle(file));
+
+    // grows the file to size if it's shorter
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, DWORD(uint64_t(size) >> 32), DWORD(size), nullptr);
+    if (mapping == nullptr) {
+        return false;
+    }
+    mu_defer(CloseHandle(mapping));
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+    if (data == nullptr) {
+        return false;
+    }
+#else
+    const int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    mu_defer(close(fd));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t(st.st_size) < size && ftruncate(fd, size) != 0)) {
+        return false;
+    }
+
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+#endif
+
+    self.data = (uint8_t*) data;
+    self.size = size;
+    return true;
+}
+
+void mapped_file_flush(MappedFile& self) {
+    if (self.data) {
+#ifdef OS_WINDOWS
+        FlushViewOfFile(self.data, self.size);
+#else
+        msync(self.data, self.size, MS_ASYNC);
+#endif
+    }
+}
+
+void mapped_file_close(MappedFile& self) {
+    if (self.data) {
+#ifdef OS_WINDOWS
+        UnmapViewOfFile(self.data);
+#else
+        munmap(self.data, self.size);
+#endif
+    }
+    self = {};
+}
@@ -0,0 +1,391 @@
+#include "Console.h"
+
+#include <algorithm>
+
+// https://www.nesdev.org/wiki/Mapper
+// bank switches only repoint rom.prg_banks and ppu.chr_banks, reads go straight through them
+
+constexpr size_t PRG_BANK_SIZE = 8 * 1024, CHR_BANK_SIZE = 1024;
+
+enum MapperNumber : uint16_t {
+    NROM = 0,
+    MMC1 = 1,
+    UXROM = 2,
+    CNROM = 3,
+    MMC3 = 4,
+    AXROM = 7,
+};
+
+// bank numbers wrap around the rom, like the unconnected high address lines do
+static void _map_prg(Console& self, uint8_t slot, size_t bank_8k) {
+    const auto& prg = self.rom.prg;
+    const size_t banks = prg.size() / PRG_BANK_SIZE;
+    self.rom.prg_banks[slot] = &prg[bank_8k % banks * PRG_BANK_SIZE];
+}
+
+static void _map_prg_16k(Console& self, uint8_t slot_16k, size_t bank_16k) {
+    _map_prg(self, slot_16k * 2, bank_16k * 2);
+    _map_prg(self, slot_16k * 2 + 1, bank_16k * 2 + 1);
+}
+
+static void _map_prg_32k(Console& self, size_t bank_32k) {
+    for (uint8_t i = 0; i < 4; i++) {
+        _map_prg(self, i, bank_32k * 4 + i);
+    }
+}
+
+static void _map_chr(Console& self, uint8_t slot, size_t bank_1k, uint8_t count = 1) {
+    auto& chr = self.rom.chr;
+    if (chr.empty()) {
+        return;
+    }
+    const size_t banks = chr.size() / CHR_BANK_SIZE;
+    for (uint8_t i = 0; i < count; i++) {
+        ppu_map_chr(self.ppu, slot + i, &chr[(bank_1k + i) % banks * CHR_BANK_SIZE]);
+    }
+}
+
+static size_t _prg_banks_16k(const Console& self) {
+    return self.rom.prg.size() / (2 * PRG_BANK_SIZE);
+}
+
+// https://www.nesdev.org/wiki/MMC1
+static void _mmc1_apply(Console& self) {
+    const auto& m = self.mapper;
+
+    constexpr Mirroring MIRRORINGS[] = {Mirroring::SINGLE_LOWER, Mirroring::SINGLE_UPPER, Mirroring::VERTICAL, Mirroring::HORIZONTAL};
+    if (self.ppu.mirroring != MIRRORINGS[m.control & 0b11]) {
+        ppu_set_mirroring(self.ppu, MIRRORINGS[m.control & 0b11]);
+    }
+
+    // 512 KB boards (SUROM) pick the 256 KB half with a chr bank bit
+    const size_t outer = _prg_banks_16k(self) > 16 ? (m.chr_bank0 & 0x10) : 0;
+    const size_t bank = outer | (m.prg_bank & 0x0F);
+    switch ((m.control >> 2) & 0b11) {
+    case 0:
+    case 1: // 32 KB, low bit ignored
+        _map_prg_32k(self, bank >> 1);
+        break;
+    case 2: // first bank fixed at $8000
+        _map_prg_16k(self, 0, outer);
+        _map_prg_16k(self, 1, bank);
+        break;
+    case 3: // last bank fixed at $C000
+        _map_prg_16k(self, 0, bank);
+        _map_prg_16k(self, 1, outer | 0x0F);
+        break;
+    }
+
+    if (m.control & 0x10) { // two 4 KB banks
+        _map_chr(self, 0, m.chr_bank0 * 4, 4);
+        _map_chr(self, 4, m.chr_bank1 * 4, 4);
+    } else {
+        _map_chr(self, 0, (m.chr_bank0 & ~1) * 4, 8);
+    }
+}
+
+static void _mmc1_write(Console& self, uint16_t addr, uint8_t data) {
+    auto& m = self.mapper;
+
+    // writes go one bit at a time through a shift register, the 5th one lands in the register
+    if (data & 0x80) {
+        m.shift = 0;
+        m.shift_count = 0;
+        m.control |= 0x0C;
+        _mmc1_apply(self);
+        return;
+    }
+
+    m.shift = (m.shift >> 1) | ((data & 1) << 4);
+    if (++m.shift_count < 5) {
+        return;
+    }
+
+    switch ((addr >> 13) & 0b11) {
+    case 0: m.control = m.shift; break;
+    case 1: m.chr_bank0 = m.shift; break;
+    case 2: m.chr_bank1 = m.shift; break;
+    case 3: m.prg_bank = m.shift; break;
+    }
+    m.shift = 0;
+    m.shift_count = 0;
+    _mmc1_apply(self);
+}
+
+// https://www.nesdev.org/wiki/MMC3
+static void _mmc3_apply(Console& self) {
+    const auto& m = self.mapper;
+    const size_t last = self.rom.prg.size() / PRG_BANK_SIZE - 1;
+
+    // bit 6 swaps which of $8000 and $C000 is switchable
+    const bool prg_swap = m.bank_select & 0x40;
+    _map_prg(self, prg_swap ? 2 : 0, m.banks[6]);
+    _map_prg(self, 1, m.banks[7]);
+    _map_prg(self, prg_swap ? 0 : 2, last - 1);
+    _map_prg(self, 3, last);
+
+    // bit 7 swaps the 2 KB and 1 KB halves of the pattern tables
+    const uint8_t half = m.bank_select & 0x80 ? 4 : 0;
+    _map_chr(self, half + 0, m.banks[0] & 0xFE, 2);
+    _map_chr(self, half + 2, m.banks[1] & 0xFE, 2);
+    for (uint8_t i = 0; i < 4; i++) {
+        _map_chr(self, (half ^ 4) + i, m.banks[2 + i]);
+    }
+}
+
+static void _mmc3_write(Console& self, uint16_t addr, uint8_t data) {
+    auto& m = self.mapper;
+
+    const bool odd = addr & 1;
+    switch (addr & 0xE000) {
+    case 0x8000:
+        if (odd) {
+            m.banks[m.bank_select & 0b111] = data;
+        } else {
+            m.bank_select = data;
+        }
+        _mmc3_apply(self);
+        break;
+    case 0xA000:
+        // $A001 is prg ram write protection, which games rely on being off anyway
+        if (!odd && self.ppu.mirroring != Mirroring::FOUR_SCREEN) {
+            ppu_set_mirroring(self.ppu, data & 1 ? Mirroring::HORIZONTAL : Mirroring::VERTICAL);
+        }
+        break;
+    case 0xC000:
+        mapper_irq_sync(self);
+        if (odd) {
+            m.irq_counter = 0;
+            m.irq_reload = true;
+        } else {
+            m.irq_latch = data;
+        }
+        mapper_irq_schedule(self);
+        break;
+    case 0xE000:
+        // $E000 also acknowledges a pending irq
+        mapper_irq_sync(self);
+        m.irq_enabled = odd;
+        if (!odd) {
+            self.cpu.irq_line = false;
+        }
+        mapper_irq_schedule(self);
+        break;
+    }
+}
+
+// the counter is clocked when the ppu's A12 rises, once per rendered line, and the dot where
+// that happens only depends on $2000/$2001, so instead of watching fetches the clocks are
+// counted in bulk and the dot where the counter reaches zero is scheduled ahead
+constexpr uint64_t NEVER = UINT64_MAX;
+constexpr int CLOCKED_LINES = 241; // 240 visible and the pre-render line
+
+// dot of a rendered line where A12 rises, -1 if it doesn't rise once per line
+static int _mmc3_a12_dot(const PPU& ppu) {
+    if (!ppu.mask.bits.show_bg && !ppu.mask.bits.show_sprites) {
+        return -1;
+    }
+    // 8x16 sprites pick the table per sprite, most games keep them at $1000
+    const bool sprites_high = ppu.ctrl.bits.sprite_size == SpriteType::S8x16 || ppu.ctrl.bits.sprite_table;
+    const bool bg_high = ppu.ctrl.bits.bg_table;
+    if (sprites_high && !bg_high) {
+        return 260; // sprite fetches
+    }
+    if (bg_high && !sprites_high) {
+        return 324; // fetches of the next line's first tiles
+    }
+    return -1;
+}
+
+// position in the frame of the i-th clock of a frame
+static int64_t _mmc3_clock_pos(int i, int a12_dot, int lines) {
+    const int line = i < 240 ? i : lines - 1;
+    return int64_t(line) * 341 + a12_dot;
+}
+
+static void _mmc3_clock(Mapper& m, uint64_t n) {
+    while (n > 0) {
+        if (m.irq_reload || m.irq_counter == 0) {
+            m.irq_counter = m.irq_latch;
+            m.irq_reload = false;
+            n--;
+        } else {
+            const uint64_t step = std::min<uint64_t>(n, m.irq_counter);
+            m.irq_counter -= step;
+            n -= step;
+        }
+    }
+}
+
+// frames are counted at the start of vblank, this counts them from the first visible line,
+// the dot skipped on odd frames only shows in console.cycles
+static uint64_t _mmc3_ppu_dot(const PPU& ppu) {
+    const auto& sys = video_system(ppu.tv_system);
+    const int64_t pos = int64_t(ppu.row) * 341 + ppu.col;
+    const uint64_t frame = ppu.frames + 1 - (pos > int64_t(sys.vblank_scanline) * 341 + 1);
+    return frame * (uint64_t(sys.scanlines_per_frame) * 341) + pos;
+}
+
+void mapper_irq_sync(Console& self) {
+    auto& m = self.mapper;
+    if (m.number != MMC3) {
+        return;
+    }
+
+    const uint64_t now = _mmc3_ppu_dot(self.ppu);
+    const uint64_t synced = m.irq_synced;
+    m.irq_synced = now;
+    const int a12_dot = _mmc3_a12_dot(self.ppu);
+    if (now <= synced || a12_dot < 0) {
+        return;
+    }
+
+    // clock positions in [synced, now)
+    const int lines = video_system(self.ppu.tv_system).scanlines_per_frame;
+    const int64_t frame = int64_t(lines) * 341;
+    const int64_t from = synced % frame;
+    const int64_t rem = (now - synced) % frame;
+
+    uint64_t clocks = (now - synced) / frame * CLOCKED_LINES;
+    for (int i = 0; i < CLOCKED_LINES; i++) {
+        const int64_t d = ((_mmc3_clock_pos(i, a12_dot, lines) - from) % frame + frame) % frame;
+        clocks += d < rem;
+    }
+    _mmc3_clock(m, clocks);
+}
+
+void mapper_irq_rebase(Console& self) {
+    self.mapper.irq_synced = _mmc3_ppu_dot(self.ppu);
+}
+
+void mapper_irq_schedule(Console& self) {
+    auto& m = self.mapper;
+    m.irq_at = NEVER;
+    const int a12_dot = _mmc3_a12_dot(self.ppu);
+    if (m.number != MMC3 || !m.irq_enabled || a12_dot < 0) {
+        return;
+    }
+
+    // the clock that leaves the counter at zero, 0 is the next one
+    const uint64_t k = (m.irq_reload || m.irq_counter == 0) ? m.irq_latch : m.irq_counter - 1;
+
+    const auto& sys = video_system(self.ppu.tv_system);
+    const int lines = sys.scanlines_per_frame;
+    const int64_t frame = int64_t(lines) * 341;
+    const int64_t now = int64_t(self.ppu.row) * 341 + self.ppu.col;
+
+    int first = 0;
+    while (first < CLOCKED_LINES && _mmc3_clock_pos(first, a12_dot, lines) < now) {
+        first++;
+    }
+    const uint64_t i = first + k;
+    const int64_t dots = _mmc3_clock_pos(i % CLOCKED_LINES, a12_dot, lines) + int64_t(i / CLOCKED_LINES) * frame - now;
+
+    // odd frames skip the last dot of the pre-render line while rendering
+    int64_t skipped = 0;
+    if (sys.skips_odd_dot) {
+        const int64_t skip_pos = int64_t(lines - 1) * 341 + 340;
+        const int64_t first_skip = ((skip_pos - now) % frame + frame) % frame;
+        if (first_skip < dots) {
+            const int64_t crossings = (dots - first_skip - 1) / frame + 1;
+            const bool vblank_started = now > int64_t(sys.vblank_scanline) * 341 + 1;
+            const bool first_odd = (self.ppu.frames + !vblank_started) % 2 == 1;
+            skipped = first_odd ? (crossings + 1) / 2 : crossings / 2;
+        }
+    }
+
+    // cycles is incremented right after the dot is ticked
+    m.irq_at = self.cycles + (dots - skipped) + 1;
+}
+
+void mapper_irq_event(Console& self) {
+    mapper_irq_sync(self);
+    if (self.mapper.irq_counter == 0 && self.mapper.irq_enabled) {
+        self.cpu.irq_line = true;
+    }
+    mapper_irq_schedule(self);
+}
+
+bool mapper_supported(uint16_t number) {
+    switch (number) {
+    case NROM: case MMC1: case UXROM: case CNROM: case MMC3: case AXROM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool mapper_has_prg_ram(const ROM& rom) {
+    // MMC1 and MMC3 boards nearly always have it, the others only when it's battery backed
+    const uint16_t number = rom_get_mapper_number(rom);
+    return number == MMC1 || number == MMC3 || rom.header.flags6.bits.has_battery_backed_prgram;
+}
+
+void mapper_reset(Console& self) {
+    self.mapper = Mapper {
+        .number = rom_get_mapper_number(self.rom),
+        .irq_at = NEVER,
+        .irq_synced = _mmc3_ppu_dot(self.ppu),
+    };
+    self.cpu.irq_line = false;
+    if (self.rom.prg.empty()) {
+        return;
+    }
+
+    switch (self.mapper.number) {
+    case MMC1:
+        self.mapper.control = 0x0C; // last bank fixed at $C000
+        _mmc1_apply(self);
+        break;
+    case UXROM:
+        _map_prg_16k(self, 0, 0);
+        _map_prg_16k(self, 1, _prg_banks_16k(self) - 1);
+        _map_chr(self, 0, 0, 8);
+        break;
+    case MMC3:
+        self.mapper.banks = {0, 2, 4, 5, 6, 7, 0, 1};
+        _mmc3_apply(self);
+        break;
+    case AXROM:
+        _map_prg_32k(self, 0);
+        _map_chr(self, 0, 0, 8);
+        ppu_set_mirroring(self.ppu, Mirroring::SINGLE_LOWER);
+        break;
+    default: // NROM, CNROM
+        _map_prg_32k(self, 0);
+        _map_chr(self, 0, 0, 8);
+        break;
+    }
+}
+
+bool mapper_write(Console& self, uint16_t addr, uint8_t data) {
+    if (!region_contains(PRG_REGION, addr)) {
+        return false;
+    }
+
+    auto& m = self.mapper;
+    switch (m.number) {
+    case MMC1:
+        _mmc1_write(self, addr, data);
+        break;
+    case UXROM:
+        m.bank = data;
+        _map_prg_16k(self, 0, data);
+        break;
+    case CNROM:
+        m.bank = data;
+        _map_chr(self, 0, data * 8, 8);
+        break;
+    case MMC3:
+        _mmc3_write(self, addr, data);
+        break;
+    case AXROM:
+        m.bank = data;
+        _map_prg_32k(self, data & 0b111);
+        ppu_set_mirroring(self.ppu, data & 0x10 ? Mirroring::SINGLE_UPPER : Mirroring::SINGLE_LOWER);
+        break;
+    default: // NROM has nothing to write to
+        break;
+    }
+    return true;
+}
@@ -1,65 +1,750 @@
 #include "Console.h"
 
-void ppu_render(const PPU& self, ScreenBuf& buf) {
-    // for now we will draw random white-black pixels
-    for (size_t y = 0; y < buf.h; y++) {
+#include <algorithm>
+#include <bit>
+
+// pattern tables are never written to by the cartridge, so unmapped slots can share it
+static uint8_t _unmapped_chr_bank[1024];
+
+static uint8_t _ppu_chr_read(const PPU& self, uint16_t addr) {
+    return self.chr_banks[addr >> 10][addr & 0x3FF];
+}
+
+static uint8_t& _ppu_palette_entry(PPU& self, uint16_t addr) {
+    uint8_t i = addr & 0x1F;
+    if ((i & 0x13) == 0x10) {
+        i &= 0x0F; // $3F10/$3F14/$3F18/$3F1C are mirrors of $3F00/$3F04/$3F08/$3F0C
+    }
+
+    if (i == 0) {
+        return self.universal_bg_index;
+    }
+    return i < 0x10 ? self.bg_palettes[i >> 2].index[i & 3] : self.sprite_palettes[(i >> 2) & 3].index[i & 3];
+}
+
+static void _ppu_raise_nmi(PPU& self) {
+    // the render worker's copy isn't wired to a cpu
+    if (self.console) {
+        self.console->cpu.nmi_pending = true;
+    }
+}
+
+static void _ppu_record(PPU& self, PPUCommand::Kind kind, uint16_t addr, uint8_t data, uint32_t chr_offset = 0) {
+    self.command_log->push_back(PPUCommand {
+        .kind = kind,
+        .data = data,
+        .addr = addr,
+        .row = self.row,
+        .col = self.col,
+        .chr_offset = chr_offset,
+    });
+}
+
+static void _bg_cache_invalidate(BgCache& self) {
+    std::fill(self.dirty_tiles.begin(), self.dirty_tiles.end(), ~uint64_t(0));
+}
+
+static void _bg_cache_mark_nametable_write(PPU& self, const uint8_t* page, uint16_t offset) {
+    // a physical page shows up in every nametable mirrored onto it
+    for (uint8_t nt = 0; nt < 4; nt++) {
+        if (self.nametables[nt] != page) {
+            continue;
+        }
+
+        const int tx0 = (nt & 1) * 32, ty0 = (nt >> 1) * 30;
+        if (offset < region_size(NAME_TBL0)) {
+            self.bg.dirty_tiles[ty0 + offset / 32] |= uint64_t(1) << (tx0 + offset % 32);
+        } else {
+            // one attribute byte covers 4x4 tiles, last row covers only 4x2
+            const int ax = (offset - region_size(NAME_TBL0)) % 8 * 4;
+            const int ay = (offset - region_size(NAME_TBL0)) / 8 * 4;
+            for (int y = ay; y < std::min(ay + 4, 30); y++) {
+                self.bg.dirty_tiles[ty0 + y] |= uint64_t(0xF) << (tx0 + ax);
+            }
+        }
+    }
+}
+
+static void _bg_cache_draw_tile(PPU& self, int tx, int ty) {
+    const uint8_t nt = (ty / 30) * 2 + (tx / 32);
+    const int cx = tx % 32, cy = ty % 30;
+
+    const uint8_t* nametable = self.nametables[nt];
+    const uint8_t tile = nametable[cy * 32 + cx];
+    const uint8_t attr = nametable[region_size(NAME_TBL0) + cy / 4 * 8 + cx / 4];
+    const uint8_t palette = (attr >> ((cy & 2) << 1 | (cx & 2))) & 0b11;
+    const uint16_t pattern = self.bg.pattern_table * region_size(PATT_TBL0) + tile * 16;
+
+    uint8_t* dst = &self.bg.plane[ty * 8 * BG_PLANE_W + tx * 8];
+    for (int j = 0; j < 8; j++, dst += BG_PLANE_W) {
+        const uint8_t l = _ppu_chr_read(self, pattern + j);
+        const uint8_t h = _ppu_chr_read(self, pattern + j + 8);
+        for (int i = 0; i < 8; i++) {
+            const uint8_t color = ((h >> (7-i)) & 1) << 1 | ((l >> (7-i)) & 1);
+            dst[i] = color ? (palette << 2 | color) : 0;
+        }
+    }
+}
+
+static void _bg_cache_update(PPU& self) {
+    auto& bg = self.bg;
+
+    if (bg.pattern_table != self.ctrl.bits.bg_table) {
+        bg.pattern_table = self.ctrl.bits.bg_table;
+        _bg_cache_invalidate(bg);
+    }
+
+    // find the plane tiles that use a changed pattern, tiles streamed into the
+    // sprite pattern table don't cost a look over the plane
+    const auto bg_chr = bg.dirty_chr.begin() + bg.pattern_table * 256 / 64;
+    const bool chr_changed = std::any_of(bg_chr, bg_chr + 256 / 64, [](uint64_t w) { return w != 0; });
+    if (chr_changed) {
+        for (int ty = 0; ty < BG_PLANE_TILES_H; ty++) {
+            for (int tx = 0; tx < BG_PLANE_TILES_W; tx++) {
+                const uint8_t nt = (ty / 30) * 2 + (tx / 32);
+                const uint16_t tile = bg.pattern_table * 256 + self.nametables[nt][ty % 30 * 32 + tx % 32];
+                if (bg.dirty_chr[tile / 64] & (uint64_t(1) << (tile % 64))) {
+                    bg.dirty_tiles[ty] |= uint64_t(1) << tx;
+                }
+            }
+        }
+    }
+    std::fill(bg.dirty_chr.begin(), bg.dirty_chr.end(), 0);
+
+    for (int ty = 0; ty < BG_PLANE_TILES_H; ty++) {
+        for (uint64_t row = bg.dirty_tiles[ty]; row != 0; row &= row - 1) {
+            _bg_cache_draw_tile(self, std::countr_zero(row), ty);
+        }
+        bg.dirty_tiles[ty] = 0;
+    }
+}
+
+// place 8 pixels starting at x in the mask, pixels after the end of the scanline are dropped
+static void _mask_or8(Mask256& self, uint8_t x, uint8_t bits) {
+    self[x / 64] |= uint64_t(bits) << (x % 64);
+    if (x % 64 > 56 && x / 64 < 3) {
+        self[x / 64 + 1] |= uint64_t(bits) >> (64 - x % 64);
+    }
+}
+
+static uint8_t _mask_get8(const Mask256& self, uint8_t x) {
+    uint64_t bits = self[x / 64] >> (x % 64);
+    if (x % 64 > 56 && x / 64 < 3) {
+        bits |= self[x / 64 + 1] << (64 - x % 64);
+    }
+    return uint8_t(bits);
+}
+
+static uint8_t _reverse_bits(uint8_t b) {
+    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+    return b;
+}
+
+// low and high bit planes of one row of a sprite, bit 0 is the leftmost pixel
+static void _sprite_row(const PPU& self, SpriteInfo sprite, int row, uint8_t& l, uint8_t& h) {
+    const bool tall = self.ctrl.bits.sprite_size == SpriteType::S8x16;
+    if (sprite.attr.bits.vFlip) {
+        row = (tall ? 15 : 7) - row;
+    }
+
+    uint16_t addr;
+    if (tall) {
+        // bit 0 of the index selects the pattern table
+        addr = (sprite.i & 1) * region_size(PATT_TBL0) + ((sprite.i & 0xFE) + row / 8) * 16 + row % 8;
+    } else {
+        addr = self.ctrl.bits.sprite_table * region_size(PATT_TBL0) + sprite.i * 16 + row;
+    }
+
+    l = _ppu_chr_read(self, addr);
+    h = _ppu_chr_read(self, addr + 8);
+    if (!sprite.attr.bits.hFlip) {
+        l = _reverse_bits(l);
+        h = _reverse_bits(h);
+    }
+}
+
+static void _ppu_evaluate_sprites(PPU& self) {
+    for (auto& line: self.scanline_sprites) {
+        line = {};
+    }
+
+    const int height = self.ctrl.bits.sprite_size == SpriteType::S8x16 ? 16 : 8;
+    for (uint8_t i = 0; i < self.oam.size(); i++) {
+        const auto sprite = self.oam[i];
+        const int top = sprite.y + 1;
+
+        for (int y = top; y < std::min(top + height, int(self.scanline_sprites.size())); y++) {
+            auto& line = self.scanline_sprites[y];
+            if (line.count == std::size(line.index)) {
+                line.overflow = true;
+                continue;
+            }
+            line.index[line.count++] = i;
+
+            uint8_t l, h;
+            _sprite_row(self, sprite, y - top, l, h);
+            const uint8_t opaque = l | h;
+
+            // sprites are in priority order, so only pixels no earlier sprite took are ours
+            if (sprite.attr.bits.priority) {
+                _mask_or8(line.behind, sprite.x, opaque & ~_mask_get8(line.coverage, sprite.x));
+            }
+            _mask_or8(line.coverage, sprite.x, opaque);
+
+            if (i == 0) {
+                line.sprite0 = opaque;
+            }
+        }
+    }
+}
+
+static bool _bg_opaque(const PPU& self, ScanlineScroll scroll, int x) {
+    return self.bg.plane[scroll.y % BG_PLANE_H * BG_PLANE_W + (scroll.x + x) % BG_PLANE_W] != 0;
+}
+
+// same as _bg_opaque but fetched from the nametables, so it doesn't need the cache to be up to date
+static bool _bg_fetch_opaque(const PPU& self, ScanlineScroll scroll, int x) {
+    const int px = (scroll.x + x) % BG_PLANE_W, py = scroll.y % BG_PLANE_H;
+    const int tx = px / 8, ty = py / 8;
+    const uint8_t nt = (ty / 30) * 2 + (tx / 32);
+    const uint8_t tile = self.nametables[nt][ty % 30 * 32 + tx % 32];
+    const uint16_t pattern = self.ctrl.bits.bg_table * region_size(PATT_TBL0) + tile * 16 + py % 8;
+    const uint8_t opaque = _ppu_chr_read(self, pattern) | _ppu_chr_read(self, pattern + 8);
+    return (opaque >> (7 - px % 8)) & 1;
+}
+
+static uint16_t _ppu_sprite0_hit_dot(PPU& self, uint16_t row) {
+    const auto& line = self.scanline_sprites[row];
+    if (line.sprite0 == 0 || !self.mask.bits.show_bg || !self.mask.bits.show_sprites) {
+        return 0;
+    }
+
+    const uint8_t x = self.oam[0].x;
+    const bool clip_left = !self.mask.bits.show_bg_left || !self.mask.bits.show_sprites_left;
+    uint8_t bg = 0;
+    for (int i = 0; i < 8; i++) {
+        const int px = x + i;
+        // no hit at x=255, nor in the clipped left 8 pixels
+        if (px < 255 && !(clip_left && px < 8) && _bg_fetch_opaque(self, self.scanline_scroll[row], px)) {
+            bg |= 1 << i;
+        }
+    }
+
+    const uint8_t hit = line.sprite0 & bg;
+    return hit ? x + std::countr_zero(hit) + 1 : 0;
+}
+
+static uint8_t _ppu_bus_read(PPU& self, uint16_t addr) {
+    addr &= 0x3FFF;
+
+    if (addr < NAME_TBL0.start) {
+        return _ppu_chr_read(self, addr);
+    }
+    if (addr < IMG_PLT.start) {
+        return self.nametables[(addr >> 10) & 0b11][addr & 0x3FF];
+    }
+    return _ppu_palette_entry(self, addr);
+}
+
+static void _ppu_bus_write(PPU& self, uint16_t addr, uint8_t data) {
+    addr &= 0x3FFF;
+
+    if (addr < NAME_TBL0.start) {
+        if (self.chr_ram) {
+            self.chr_banks[addr >> 10][addr & 0x3FF] = data;
+            self.bg.dirty_chr[addr / 16 / 64] |= uint64_t(1) << (addr / 16 % 64);
+        }
+    } else if (addr < IMG_PLT.start) {
+        uint8_t* page = self.nametables[(addr >> 10) & 0b11];
+        const uint16_t offset = addr & 0x3FF;
+        if constexpr (WRITE_TRACKING) {
+            if (self.console) { // the render worker's copy has nothing to track for
+                dirty_bitmap_mark(self.console->dirty.ciram, page - self.ciram.data() + offset);
+            }
+        }
+        if (page[offset] != data) {
+            page[offset] = data;
+            _bg_cache_mark_nametable_write(self, page, offset);
+        }
+    } else {
+        _ppu_palette_entry(self, addr) = data & 0x3F;
+    }
+}
+
+// https://www.nesdev.org/wiki/PPU_scrolling#Wrapping_around
+static uint16_t _increment_y(uint16_t v) {
+    if ((v & 0x7000) != 0x7000) {
+        return v + 0x1000; // fine y
+    }
+
+    v &= ~0x7000;
+    uint16_t coarse_y = (v & 0x03E0) >> 5;
+    if (coarse_y == 29) {
+        coarse_y = 0;
+        v ^= 0x0800; // switch vertical nametable
+    } else if (coarse_y == 31) {
+        coarse_y = 0;
+    } else {
+        coarse_y++;
+    }
+    return (v & ~0x03E0) | (coarse_y << 5);
+}
+
+static ScanlineScroll _scroll_from_v(const PPU& self) {
+    const uint16_t coarse_x = self.v & 0x1F, coarse_y = (self.v >> 5) & 0x1F;
+    const uint16_t fine_y = (self.v >> 12) & 0b111;
+    const uint16_t nt_x = (self.v >> 10) & 1, nt_y = (self.v >> 11) & 1;
+    return ScanlineScroll {
+        .x = uint16_t(nt_x * 256 + coarse_x * 8 + self.fine_x),
+        .y = uint16_t(nt_y * 240 + (coarse_y * 8 + fine_y) % 240),
+    };
+}
+
+PPU ppu_new(Console* console) {
+    PPU self {
+        .console = console,
+    };
+
+    self.bg.plane = mu::Vec<uint8_t>(BG_PLANE_W * BG_PLANE_H, 0);
+    for (auto& bank: self.chr_banks) {
+        bank = _unmapped_chr_bank;
+    }
+    ppu_reset(self);
+
+    return self;
+}
+
+void ppu_reset(PPU& self) {
+    // https://www.nesdev.org/wiki/PPU_power_up_state
+    // frames start from the pre-render scanline
+    self.row = video_system(self.tv_system).scanlines_per_frame - 1;
+    self.col = 0;
+    self.ctrl.byte = 0;
+    self.mask.byte = 0;
+    self.write_toggle = false;
+    self.read_buffer = 0;
+
+    _bg_cache_invalidate(self.bg);
+}
+
+void ppu_set_mirroring(PPU& self, Mirroring mirroring) {
+    static constexpr uint8_t PAGES[][4] = {
+        {0, 0, 1, 1}, // HORIZONTAL
+        {0, 1, 0, 1}, // VERTICAL
+        {0, 0, 0, 0}, // SINGLE_LOWER
+        {1, 1, 1, 1}, // SINGLE_UPPER
+        {0, 1, 2, 3}, // FOUR_SCREEN
+    };
+
+    if (self.command_log) {
+        _ppu_record(self, PPUCommand::Kind::MIRRORING, 0, (uint8_t) mirroring);
+    }
+
+    if (self.mirroring != mirroring) {
+        self.mirroring = mirroring;
+        _bg_cache_invalidate(self.bg);
+    }
+
+    for (int i = 0; i < 4; i++) {
+        self.nametables[i] = &self.ciram[PAGES[(int) mirroring][i] * 0x400];
+    }
+}
+
+void ppu_map_chr(PPU& self, uint8_t slot, uint8_t* bank) {
+    if (self.command_log) {
+        const auto& chr = self.console->rom.chr;
+        const bool in_rom = bank >= chr.data() && bank < chr.data() + chr.size();
+        _ppu_record(self, PPUCommand::Kind::MAP_CHR, 0, slot, in_rom ? uint32_t(bank - chr.data()) : PPUCommand::UNMAPPED);
+    }
+
+    if (self.chr_banks[slot] != bank) {
+        self.chr_banks[slot] = bank;
+        self.bg.dirty_chr[slot] = ~uint64_t(0); // a 1 KB bank is 64 tiles
+    }
+}
+
+void ppu_save_state(const PPU& self, PPUState& state) {
+    state.frames = self.frames;
+    state.row = self.row;
+    state.col = self.col;
+    state.v = self.v;
+    state.t = self.t;
+    state.sprite0_hit_dot = self.sprite0_hit_dot;
+    state.ctrl = self.ctrl.byte;
+    state.mask = self.mask.byte;
+    state.status = self.status.byte;
+    state.fine_x = self.fine_x;
+    state.write_toggle = self.write_toggle;
+    state.read_buffer = self.read_buffer;
+    state.oam_addr = self.oam_addr;
+    state.tv_system = self.tv_system;
+    state.mirroring = self.mirroring;
+    state.chr_ram = self.chr_ram;
+    state.universal_bg_index = self.universal_bg_index;
+    memcpy(state.bg_palettes, self.bg_palettes, sizeof(state.bg_palettes));
+    memcpy(state.sprite_palettes, self.sprite_palettes, sizeof(state.sprite_palettes));
+
+    const auto& chr = self.console->rom.chr;
+    for (uint8_t slot = 0; slot < self.chr_banks.size(); slot++) {
+        const uint8_t* bank = self.chr_banks[slot];
+        const bool in_rom = bank >= chr.data() && bank < chr.data() + chr.size();
+        state.chr_banks[slot] = in_rom ? uint32_t(bank - chr.data()) : PPUCommand::UNMAPPED;
+    }
+
+    state.ciram = self.ciram;
+    state.oam = self.oam;
+    state.scanline_scroll = self.scanline_scroll;
+}
+
+void ppu_load_state(PPU& self, const PPUState& state, const uint8_t* chr_ram) {
+    auto& chr = self.console->rom.chr;
+
+    self.frames = state.frames;
+    self.row = state.row;
+    self.col = state.col;
+    self.v = state.v;
+    self.t = state.t;
+    self.sprite0_hit_dot = state.sprite0_hit_dot;
+    self.ctrl.byte = state.ctrl;
+    self.mask.byte = state.mask;
+    self.status.byte = state.status;
+    self.fine_x = state.fine_x;
+    self.write_toggle = state.write_toggle;
+    self.read_buffer = state.read_buffer;
+    self.oam_addr = state.oam_addr;
+    self.tv_system = state.tv_system;
+    self.chr_ram = state.chr_ram;
+    self.universal_bg_index = state.universal_bg_index;
+    memcpy(self.bg_palettes, state.bg_palettes, sizeof(self.bg_palettes));
+    memcpy(self.sprite_palettes, state.sprite_palettes, sizeof(self.sprite_palettes));
+
+    // a state saved a few frames ago differs in a handful of bytes,
+    // so compare before copying and keep the rest of the cached background
+    ppu_set_mirroring(self, state.mirroring);
+    for (uint16_t offset = 0; offset < self.ciram.size(); offset += 8) {
+        if (memcmp(&self.ciram[offset], &state.ciram[offset], 8) == 0) {
+            continue;
+        }
+        for (uint16_t i = offset; i < offset + 8; i++) {
+            if (self.ciram[i] != state.ciram[i]) {
+                _bg_cache_mark_nametable_write(self, &self.ciram[i & ~0x3FF], i & 0x3FF);
+            }
+        }
+    }
+    self.ciram = state.ciram;
+
+    for (uint8_t slot = 0; slot < self.chr_banks.size(); slot++) {
+        const uint32_t offset = state.chr_banks[slot];
+        const bool in_rom = offset != PPUCommand::UNMAPPED && offset + 1024 <= chr.size();
+        ppu_map_chr(self, slot, in_rom ? &chr[offset] : _unmapped_chr_bank);
+    }
+
+    if (self.chr_ram && chr_ram) {
+        for (uint8_t slot = 0; slot < self.chr_banks.size(); slot++) {
+            const uint8_t* bank = self.chr_banks[slot];
+            if (bank == _unmapped_chr_bank) {
+                continue;
+            }
+            const uint8_t* saved = chr_ram + (bank - chr.data());
+            for (int tile = 0; tile < 64; tile++) {
+                if (memcmp(bank + tile * 16, saved + tile * 16, 16) != 0) {
+                    self.bg.dirty_chr[slot] |= uint64_t(1) << tile;
+                }
+            }
+        }
+        memcpy(chr.data(), chr_ram, chr.size());
+    }
+
+    self.oam = state.oam;
+    self.scanline_scroll = state.scanline_scroll;
+    _ppu_evaluate_sprites(self);
+}
+
+template <TVSystem TV>
+void ppu_tick(PPU& self) {
+    constexpr auto& sys = video_system(TV);
+    constexpr uint16_t prerender = sys.scanlines_per_frame - 1;
+    const bool rendering = self.mask.bits.show_bg || self.mask.bits.show_sprites;
+
+    if (self.row < 240 && self.col == 0) {
+        if (self.row == 0) {
+            _ppu_evaluate_sprites(self);
+        }
+
+        self.scanline_scroll[self.row] = _scroll_from_v(self);
+
+        if (rendering && self.scanline_sprites[self.row].overflow) {
+            self.status.bits.sprite_overflow = 1;
+        }
+        self.sprite0_hit_dot = self.status.bits.sprite0_hit ? 0 : _ppu_sprite0_hit_dot(self, self.row);
+    } else if (self.sprite0_hit_dot != 0 && self.col == self.sprite0_hit_dot) {
+        self.status.bits.sprite0_hit = 1;
+        self.sprite0_hit_dot = 0;
+    }
+
+    // only the per-scanline updates of v are emulated,
+    // the background itself is drawn from the cache in ppu_render
+    if (rendering && (self.row < 240 || self.row == prerender)) {
+        if (self.col == 256) {
+            self.v = _increment_y(self.v);
+        } else if (self.col == 257) {
+            self.v = (self.v & ~0x041F) | (self.t & 0x041F);
+        } else if (self.row == prerender && self.col >= 280 && self.col <= 304) {
+            self.v = (self.v & ~0x7BE0) | (self.t & 0x7BE0);
+        }
+    }
+
+    if (self.row == sys.vblank_scanline && self.col == 1) {
+        self.frames++;
+        self.status.bits.vblank = 1;
+        if (self.ctrl.bits.nmi) {
+            _ppu_raise_nmi(self);
+        }
+    } else if (self.row == prerender && self.col == 1) {
+        self.status.byte = 0;
+    }
+
+    uint16_t last_dot = 340;
+    if constexpr (sys.skips_odd_dot) {
+        if (self.row == prerender && rendering && self.frames % 2 == 1) {
+            last_dot = 339;
+        }
+    }
+
+    if (++self.col > last_dot) {
+        self.col = 0;
+        if (++self.row > prerender) {
+            self.row = 0;
+        }
+    }
+}
+
+template void ppu_tick<TVSystem::NTSC>(PPU& self);
+template void ppu_tick<TVSystem::PAL>(PPU& self);
+template void ppu_tick<TVSystem::DENDY>(PPU& self);
+
+void ppu_clock(PPU& self) {
+    switch (self.tv_system) {
+    case TVSystem::NTSC: ppu_tick<TVSystem::NTSC>(self); break;
+    case TVSystem::PAL: ppu_tick<TVSystem::PAL>(self); break;
+    case TVSystem::DENDY: ppu_tick<TVSystem::DENDY>(self); break;
+    }
+}
+
+bool ppu_read(PPU& self, uint16_t addr, uint8_t& data) {
+    if (!region_contains(IO_REGS0_REGION, addr)) {
+        return false;
+    }
+
+    // only these reads have side effects on the internal registers
+    if (self.command_log && ((addr & 0x0007) == 0x0002 || (addr & 0x0007) == 0x0007)) {
+        _ppu_record(self, PPUCommand::Kind::READ, addr, 0);
+    }
+
+    switch (addr & 0x0007) {
+    case 0x0004: // OAM Data
+        data = ((uint8_t*) self.oam.data())[self.oam_addr];
+        break;
+    case 0x0002: // Status
+        data = (self.status.byte & 0xE0) | (self.read_buffer & 0x1F);
+        self.status.bits.vblank = 0;
+        self.write_toggle = false;
+        break;
+    case 0x0007: { // PPU Data
+        const uint16_t vaddr = self.v & 0x3FFF;
+        if (vaddr >= IMG_PLT.start) {
+            // palette reads aren't delayed, buffer gets the nametable byte "under" the palette
+            data = _ppu_bus_read(self, vaddr);
+            self.read_buffer = _ppu_bus_read(self, vaddr - 0x1000);
+        } else {
+            data = self.read_buffer;
+            self.read_buffer = _ppu_bus_read(self, vaddr);
+        }
+        self.v += self.ctrl.bits.increment ? 32 : 1;
+        break;
+    }
+    default: // write only
+        data = 0;
+        break;
+    }
+    return true;
+}
+
+// the mmc3 counts A12 rises, which move with the pattern tables, sprite size and rendering
+static void _ppu_mapper_irq_sync(PPU& self) {
+    if (self.console) {
+        mapper_irq_sync(*self.console);
+    }
+}
+
+static void _ppu_mapper_irq_schedule(PPU& self) {
+    if (self.console) {
+        mapper_irq_schedule(*self.console);
+    }
+}
+
+bool ppu_write(PPU& self, uint16_t addr, uint8_t data) {
+    if (!region_contains(IO_REGS0_REGION, addr)) {
+        return false;
+    }
+
+    if (self.command_log) {
+        _ppu_record(self, PPUCommand::Kind::WRITE, addr, data);
+    }
+
+    switch (addr & 0x0007) {
+    case 0x0000: { // Control
+        const bool nmi_was_enabled = self.ctrl.bits.nmi;
+        _ppu_mapper_irq_sync(self);
+        self.ctrl.byte = data;
+        self.t = (self.t & ~0x0C00) | ((data & 0b11) << 10);
+        _ppu_mapper_irq_schedule(self);
+
+        // enabling NMI during vblank fires it immediately
+        if (!nmi_was_enabled && self.ctrl.bits.nmi && self.status.bits.vblank) {
+            _ppu_raise_nmi(self);
+        }
+        break;
+    }
+    case 0x0001: // Mask
+        _ppu_mapper_irq_sync(self);
+        self.mask.byte = data;
+        _ppu_mapper_irq_schedule(self);
+        break;
+    case 0x0003: // OAM Address
+        self.oam_addr = data;
+        break;
+    case 0x0004: // OAM Data
+        if constexpr (WRITE_TRACKING) {
+            if (self.console) {
+                dirty_bitmap_mark(self.console->dirty.oam, self.oam_addr);
+            }
+        }
+        ((uint8_t*) self.oam.data())[self.oam_addr++] = data;
+        break;
+    case 0x0005: // Scroll
+        if (!self.write_toggle) {
+            self.t = (self.t & ~0x001F) | (data >> 3);
+            self.fine_x = data & 0b111;
+        } else {
+            self.t = (self.t & ~0x73E0) | ((data & 0b111) << 12) | ((data >> 3) << 5);
+        }
+        self.write_toggle = !self.write_toggle;
+        break;
+    case 0x0006: // PPU Address
+        if (!self.write_toggle) {
+            self.t = (self.t & 0x00FF) | ((data & 0x3F) << 8);
+        } else {
+            self.t = (self.t & 0xFF00) | data;
+            self.v = self.t;
+        }
+        self.write_toggle = !self.write_toggle;
+        break;
+    case 0x0007: // PPU Data
+        _ppu_bus_write(self, self.v, data);
+        self.v += self.ctrl.bits.increment ? 32 : 1;
+        break;
+    default: // read only, or not implemented yet
+        break;
+    }
+    return true;
+}
+
+static void _ppu_render_sprites(PPU& self, size_t y, RGBAColor* dst, size_t w) {
+    const auto& line = self.scanline_sprites[y];
+    if (line.count == 0) {
+        return;
+    }
+
+    RGBAColor sprite_colors[16];
+    for (uint8_t i = 0; i < 16; i++) {
+        sprite_colors[i] = color_from_palette(self.sprite_palettes[i >> 2].index[i & 0b11]);
+    }
+
+    // background pixels under the sprites, only needed where a sprite is behind it
+    Mask256 bg_opaque {};
+    if (self.mask.bits.show_bg) {
+        for (int w = 0; w < 4; w++) {
+            for (uint64_t bits = line.behind[w]; bits != 0; bits &= bits - 1) {
+                const int x = w * 64 + std::countr_zero(bits);
+                if (_bg_opaque(self, self.scanline_scroll[y], x)) {
+                    bg_opaque[w] |= uint64_t(1) << (x % 64);
+                }
+            }
+        }
+        if (!self.mask.bits.show_bg_left) {
+            bg_opaque[0] &= ~uint64_t(0xFF);
+        }
+    }
+
+    Mask256 visible;
+    for (int w = 0; w < 4; w++) {
+        visible[w] = line.coverage[w] & ~(line.behind[w] & bg_opaque[w]);
+    }
+    if (!self.mask.bits.show_sprites_left) {
+        visible[0] &= ~uint64_t(0xFF);
+    }
+
+    // draw back to front, so the lowest index wins, but only on the visible pixels
+    for (int k = line.count - 1; k >= 0; k--) {
+        const auto sprite = self.oam[line.index[k]];
+        const uint8_t show = _mask_get8(visible, sprite.x);
+        if (show == 0) {
+            continue;
+        }
+
+        uint8_t l, h;
+        _sprite_row(self, sprite, int(y) - (sprite.y + 1), l, h);
+        for (uint8_t bits = show & (l | h); bits != 0; bits &= bits - 1) {
+            const int i = std::countr_zero(bits);
+            if (sprite.x + i >= int(w)) {
+                break;
+            }
+            const uint8_t color = ((h >> i) & 1) << 1 | ((l >> i) & 1);
+            dst[sprite.x + i] = sprite_colors[sprite.attr.bits.color << 2 | color];
+        }
+    }
+}
+
+void ppu_render_scanline(PPU& self, size_t y, ScreenBuf& buf) {
+    if (y >= buf.h || y >= self.scanline_scroll.size()) {
+        return;
+    }
+
+    _bg_cache_update(self);
+
+    RGBAColor bg_colors[16];
+    for (uint8_t i = 0; i < 16; i++) {
+        bg_colors[i] = color_from_palette((i & 0b11) ? self.bg_palettes[i >> 2].index[i & 0b11] : self.universal_bg_index);
+    }
+    const RGBAColor backdrop = bg_colors[0];
+
+    // copy this scanline's window out of the plane
+    RGBAColor* dst = &buf.pixels[y * buf.w];
+    if (self.mask.bits.show_bg) {
+        const auto scroll = self.scanline_scroll[y];
+        const uint8_t* src = &self.bg.plane[scroll.y % BG_PLANE_H * BG_PLANE_W];
         for (size_t x = 0; x < buf.w; x++) {
-            screenbuf_put(buf, x, y, rand()%10 == 0? RGBAColor{}:RGBAColor{255,255,255,255});
-        }
-    }
-}
-
-// void ppu_clock(PPU& self) {
-//     // TODO
-// }
-
-// void ppu_reset(PPU& self) {
-//     // TODO
-//     self.cycles = 0;
-// }
-
-// bool ppu_read(PPU& self, uint16_t addr, uint8_t& data) {
-//     // TODO
-//     switch (addr) {
-//     case 0x0000: // Control
-//         break;
-//     case 0x0001: // Mask
-//         break;
-//     case 0x0002: // Status
-//         break;
-//     case 0x0003: // OAM Address
-//         break;
-//     case 0x0004: // OAM Data
-//         break;
-//     case 0x0005: // Scroll
-//         break;
-//     case 0x0006: // PPU Address
-//         break;
-//     case 0x0007: // PPU Data
-//         break;
-//     }
-//     return false;
-// }
-
-// bool ppu_write(PPU& self, uint16_t addr, uint8_t data) {
-//     // TODO
-//     switch (addr) {
-//     case 0x0000: // Control
-//         break;
-//     case 0x0001: // Mask
-//         break;
-//     case 0x0002: // Status
-//         break;
-//     case 0x0003: // OAM Address
-//         break;
-//     case 0x0004: // OAM Data
-//         break;
-//     case 0x0005: // Scroll
-//         break;
-//     case 0x0006: // PPU Address
-//         break;
-//     case 0x0007: // PPU Data
-//         break;
-//     }
-//     return false;
-// }
+            dst[x] = bg_colors[src[(scroll.x + x) % BG_PLANE_W]];
+        }
+
+        if (!self.mask.bits.show_bg_left) {
+            std::fill(dst, dst + 8, backdrop);
+        }
+    } else {
+        std::fill(dst, dst + buf.w, backdrop);
+    }
+
+    if (self.mask.bits.show_sprites) {
+        _ppu_render_sprites(self, y, dst, buf.w);
+    }
+}
+
+void ppu_render(PPU& self, ScreenBuf& buf) {
+    // scanline by scanline to keep mid-frame scroll splits
+    for (size_t y = 0; y < buf.h; y++) {
+        ppu_render_scanline(self, y, buf);
+    }
+}
@@ -0,0 +1,198 @@
+#include "Console.h"
+
+// https://zerosoft.zophar.net/ips.php
+// "PATCH", then records of [offset u24][size u16][bytes], or [offset u24][0][run u16][byte], then "EOF" and
+// an optional truncated size u24, all big endian
+
+static uint32_t _be(const uint8_t* p, int n) {
+    uint32_t v = 0;
+    for (int i = 0; i < n; i++) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+// walks the records, calling write(offset, size, bytes or nullptr, rle byte) for each,
+// returns where "EOF" ends, or 0 if the patch is cut short
+template <typename F>
+static size_t _ips_walk(const uint8_t* patch, size_t patch_size, F&& write) {
+    if (patch_size < 8 || memcmp(patch, "PATCH", 5) != 0) {
+        return 0;
+    }
+
+    size_t at = 5;
+    while (at + 3 <= patch_size) {
+        if (memcmp(patch + at, "EOF", 3) == 0) {
+            return at + 3;
+        }
+        if (at + 5 > patch_size) {
+            return 0;
+        }
+        const uint32_t offset = _be(patch + at, 3);
+        const uint32_t size = _be(patch + at + 3, 2);
+        at += 5;
+
+        if (size > 0) {
+            if (at + size > patch_size) {
+                return 0;
+            }
+            write(offset, size, patch + at, 0);
+            at += size;
+        } else {
+            if (at + 3 > patch_size) {
+                return 0;
+            }
+            write(offset, _be(patch + at, 2), nullptr, patch[at + 2]);
+            at += 3;
+        }
+    }
+    return 0;
+}
+
+bool ips_target_size(const uint8_t* patch, size_t patch_size, size_t source_size, size_t& target_size) {
+    target_size = source_size;
+    const size_t end = _ips_walk(patch, patch_size, [&](uint32_t offset, uint32_t size, const uint8_t*, uint8_t) {
+        target_size = std::max<size_t>(target_size, offset + size);
+    });
+
+    // a size after EOF truncates the target
+    if (end != 0 && end + 3 == patch_size) {
+        target_size = _be(patch + end, 3);
+    }
+    return end != 0;
+}
+
+bool ips_apply(const uint8_t* patch, size_t patch_size, uint8_t* target, size_t target_size) {
+    return 0 != _ips_walk(patch, patch_size, [&](uint32_t offset, uint32_t size, const uint8_t* bytes, uint8_t rle) {
+        // records past a truncated end are dropped
+        if (offset >= target_size) {
+            return;
+        }
+        size = std::min<size_t>(size, target_size - offset);
+        if (bytes) {
+            memcpy(target + offset, bytes, size);
+        } else {
+            memset(target + offset, rle, size);
+        }
+    });
+}
+
+// https://github.com/blakesmith/rombp/blob/master/docs/bps_spec.md
+// "BPS1", source/target/metadata sizes, metadata, actions, then the source, target and patch crc32s
+
+static bool _bps_number(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+    v = 0;
+    for (uint64_t shift = 1; p < end && shift < (uint64_t(1) << 56); shift <<= 7) {
+        const uint8_t x = *p++;
+        v += (x & 0x7F) * shift;
+        if (x & 0x80) {
+            return true;
+        }
+        v += shift << 7;
+    }
+    return false;
+}
+
+bool bps_target_size(const uint8_t* patch, size_t patch_size, size_t& target_size) {
+    const uint8_t* p = patch + 4;
+    const uint8_t* end = patch + patch_size;
+    uint64_t source, target;
+    if (patch_size < 4 + 3 + 12 || memcmp(patch, "BPS1", 4) != 0 || !_bps_number(p, end, source) || !_bps_number(p, end, target)) {
+        return false;
+    }
+
+    // checked before the target is allocated, the size is only what the patch claims
+    uint32_t patch_crc;
+    memcpy(&patch_crc, end - 4, 4);
+    if (crc32(patch, patch_size - 4) != patch_crc || target > ROM_MAX_SIZE) {
+        return false;
+    }
+    target_size = target;
+    return true;
+}
+
+bool bps_apply(const uint8_t* patch, size_t patch_size, const uint8_t* source, size_t source_size, uint8_t* target, size_t target_size) {
+    if (patch_size < 4 + 3 + 12 || memcmp(patch, "BPS1", 4) != 0) {
+        return false;
+    }
+
+    const uint8_t* footer = patch + patch_size - 12;
+    uint32_t source_crc, target_crc, patch_crc;
+    memcpy(&source_crc, footer, 4);
+    memcpy(&target_crc, footer + 4, 4);
+    memcpy(&patch_crc, footer + 8, 4);
+    if (crc32(patch, patch_size - 4) != patch_crc || crc32(source, source_size) != source_crc) {
+        mu::log_error("bps patch is corrupt or for another rom");
+        return false;
+    }
+
+    const uint8_t* p = patch + 4;
+    uint64_t source_header_size, target_header_size, metadata_size;
+    if (!_bps_number(p, footer, source_header_size) || !_bps_number(p, footer, target_header_size) ||
+        !_bps_number(p, footer, metadata_size) || source_header_size != source_size ||
+        target_header_size != target_size || metadata_size > uint64_t(footer - p)) {
+        return false;
+    }
+    p += metadata_size;
+
+    size_t out = 0;
+    int64_t source_offset = 0, target_offset = 0;
+    while (p < footer) {
+        uint64_t action;
+        if (!_bps_number(p, footer, action)) {
+            return false;
+        }
+        const uint64_t length = (action >> 2) + 1;
+        if (length > target_size - out) {
+            return false;
+        }
+
+        switch (action & 3) {
+        case 0: // SourceRead, the same bytes as the source at this offset
+            if (out + length > source_size) {
+                return false;
+            }
+            memcpy(target + out, source + out, length);
+            break;
+        case 1: // TargetRead, bytes from the patch
+            if (length > uint64_t(footer - p)) {
+                return false;
+            }
+            memcpy(target + out, p, length);
+            p += length;
+            break;
+        case 2: // SourceCopy, from anywhere in the source
+        case 3: { // TargetCopy, from what's been written, can overlap like lz77
+            uint64_t delta;
+            if (!_bps_number(p, footer, delta)) {
+                return false;
+            }
+            int64_t& offset = (action & 3) == 2 ? source_offset : target_offset;
+            offset += (delta & 1 ? -1 : 1) * int64_t(delta >> 1);
+
+            if ((action & 3) == 2) {
+                if (offset < 0 || uint64_t(offset) + length > source_size) {
+                    return false;
+                }
+                memcpy(target + out, source + offset, length);
+            } else {
+                if (offset < 0 || uint64_t(offset) >= out) {
+                    return false;
+                }
+                for (uint64_t i = 0; i < length; i++) {
+                    target[out + i] = target[offset + i];
+                }
+            }
+            offset += length;
+            break;
+        }
+        }
+        out += length;
+    }
+
+    if (out != target_size || crc32(target, target_size) != target_crc) {
+        mu::log_error("bps patch produced a different rom than it expected");
+        return false;
+    }
+    return true;
+}
@@ -1,5 +1,7 @@
 #include "Console.h"
 
+#include <filesystem>
+
 static uint32_t rom_get_prg_rom_size(const ROM& self) {
     return self.header.num_prgs*16*1024; // 16 KB
 }
@@ -8,82 +10,202 @@ static uint32_t rom_get_chr_rom_size(const ROM& self) {
     return self.header.num_chrs*8*1024; // 8 KB
 }
 
-inline static mu::Vec<uint8_t>
-_file_content_bin(const char* path, mu::memory::Allocator* allocator = mu::memory::default_allocator()) {
-    auto file = fopen(path, "rb");
-    if (file == nullptr) {
-        mu::panic("failed to open file '{}' for reading", path);
+RomError rom_parse_ines(ROM& self, uint8_t* data, size_t size, const RomDb* db) {
+    // copy header
+    if (size < sizeof(self.header)) {
+        return RomError::TRUNCATED;
     }
-    mu_defer(fclose(file));
+	self.header = *(INESFileHeader*) data;
 
-    if (fseek(file, 0, SEEK_END)) {
-        mu::panic("failed to seek in file '{}' for reading", path);
+    constexpr uint8_t ines_magic[] = {0x4E, 0x45, 0x53, 0x1A}; // ("NES" + MS/DOS EOF)
+    if (memcmp(self.header._magic, ines_magic, 4) != 0) {
+        return RomError::BAD_HEADER;
     }
-    const auto expected_size = ftell(file);
-    if (fseek(file, 0, SEEK_SET)) {
-        mu::panic("failed to seek back in file '{}' for reading", path);
+
+    // PRG, in place, after the trainer if any
+    uint8_t* prg_ptr = data+sizeof(self.header);
+    if (self.header.flags6.bits.has_trainer) {
+        prg_ptr += 512;
     }
 
-    mu::Vec<uint8_t> content(expected_size, 0, allocator);
-    const auto read_size = fread(content.data(), 1, expected_size, file);
-    if (read_size != expected_size) {
-        mu::panic("failed to read file '{}', expected to read {} bytes but got {} bytes", path, expected_size, read_size);
+    auto prg_size = rom_get_prg_rom_size(self);
+    if (prg_ptr+prg_size > data+size) {
+        return RomError::TRUNCATED;
+    }
+    self.prg = {prg_ptr, prg_size};
+
+    // CHR, in place
+    uint8_t* chr_ptr = prg_ptr+prg_size;
+
+    auto chr_size = rom_get_chr_rom_size(self);
+    if (chr_ptr+chr_size > data+size) {
+        return RomError::TRUNCATED;
+    }
+    self.chr = {chr_ptr, chr_size};
+
+    self.crc = crc32(self.prg.data(), self.prg.size());
+    self.crc = crc32(self.chr.data(), self.chr.size(), self.crc);
+
+    if (db) {
+        if (auto entry = romdb_find(*db, self)) {
+            rom_apply_db_entry(self, *entry);
+            mu::log_info("header corrected from the rom database");
+        }
     }
 
-    return content;
+    return RomError::NONE;
 }
 
-void rom_from_ines_file(ROM& self, const mu::Str& ines_path) {
-    auto file = _file_content_bin(ines_path.c_str(), mu::memory::tmp());
-    uint8_t* buffer = (uint8_t*) file.data();
+// an ips that doesn't grow the file patches it in place, the mapping is private so only
+// the pages it touches get copied, a bps or a growing ips writes the result into self.image
+static RomError _rom_patch(ROM& self, const mu::Str& ines_path, uint8_t*& data, size_t& size) {
+    for (auto ext : {".ips", ".bps"}) {
+        auto patch_path = std::filesystem::path(ines_path.c_str()).replace_extension(ext).string();
+        MappedFile patch {};
+        if (!std::filesystem::exists(patch_path) || !mapped_file_open(patch, patch_path.c_str())) {
+            continue;
+        }
+        mu_defer(mapped_file_close(patch));
 
-    // copy header
-    if (file.size() < sizeof(self.header)) {
-        mu::panic("too small iNES file");
+        size_t target_size;
+        if (ext == mu::StrView(".ips")) {
+            if (!ips_target_size(patch.data, patch.size, size, target_size)) {
+                mu::log_error("corrupt ips patch '{}'", patch_path);
+                return RomError::BAD_PATCH;
+            }
+            if (target_size > size) {
+                if (data != self.image.data()) {
+                    self.image.assign(data, data + size);
+                }
+                self.image.resize(target_size);
+                data = self.image.data();
+            }
+            if (!ips_apply(patch.data, patch.size, data, target_size)) {
+                mu::log_error("ips patch '{}' doesn't apply to '{}'", patch_path, ines_path);
+                return RomError::BAD_PATCH;
+            }
+        } else {
+            // the source can't be overwritten while it's read, so image is built aside if it's the source
+            mu::Vec<uint8_t> target;
+            if (!bps_target_size(patch.data, patch.size, target_size)) {
+                mu::log_error("corrupt bps patch '{}'", patch_path);
+                return RomError::BAD_PATCH;
+            }
+            target.resize(target_size);
+            if (!bps_apply(patch.data, patch.size, data, size, target.data(), target.size())) {
+                mu::log_error("bps patch '{}' doesn't apply to '{}'", patch_path, ines_path);
+                return RomError::BAD_PATCH;
+            }
+            self.image = std::move(target);
+            data = self.image.data();
+        }
+        size = target_size;
+
+        if (data == self.image.data()) {
+            mapped_file_close(self.file);
+        }
+        mu::log_info("patched '{}' with '{}'", ines_path, patch_path);
+        return RomError::NONE;
     }
-	self.header = *(INESFileHeader*) buffer;
+    return RomError::NONE;
+}
 
-    constexpr uint8_t ines_magic[] = {0x4E, 0x45, 0x53, 0x1A}; // ("NES" + MS/DOS EOF)
-    if (memcmp(self.header._magic, ines_magic, 4) != 0) {
-        mu::panic("no iNES header");
+const char* rom_error_str(RomError error) {
+    switch (error) {
+    case RomError::NONE: return "no error";
+    case RomError::UNREADABLE: return "can't read the file";
+    case RomError::BAD_HEADER: return "no iNES header";
+    case RomError::TRUNCATED: return "file is shorter than its header says";
+    case RomError::UNSUPPORTED_MAPPER: return "mapper isn't supported";
+    case RomError::NO_PRG: return "no PRG ROM";
+    case RomError::BAD_ZIP: return "no usable .nes in the zip";
+    case RomError::BAD_PATCH: return "patch doesn't apply";
     }
+    return "unknown error";
+}
 
-    // copy PRG
-    uint8_t* prg_ptr = buffer+sizeof(self.header);
-    if (self.header.flags6.bits.has_trainer) {
-        mu::log_warning("emulator doesnt support trainers, ignoring trainer");
-        prg_ptr += 512;
+static RomError _rom_load_ines_file(ROM& self, const mu::Str& ines_path, const RomDb* db, const mu::Str& sav_path) {
+    if (!mapped_file_open(self.file, ines_path.c_str())) {
+        mu::log_error("failed to map file '{}' for reading", ines_path);
+        return RomError::UNREADABLE;
     }
+    uint8_t* data = self.file.data;
+    size_t size = self.file.size;
 
-    auto prg_size = rom_get_prg_rom_size(self);
-    if (prg_ptr+prg_size > buffer+file.size()) {
-        mu::panic("no PRG ROM");
+    // a stored .nes is used in place, a deflated one is inflated once into its final buffer
+    if (zip_is(data, size)) {
+        ZipMember member;
+        if (!zip_find(data, size, ".nes", member)) {
+            mu::log_error("no .nes file in zip '{}'", ines_path);
+            return RomError::BAD_ZIP;
+        }
+
+        if (member.method == 0 && member.compressed_size == member.size) {
+            data = member.data;
+        } else if (member.method == 8) {
+            // the size is only what the zip claims, deflate can't do better than 1032:1
+            if (member.size > ROM_MAX_SIZE || member.size > uint64_t(member.compressed_size) * 1032 + 258) {
+                mu::log_error("corrupt .nes in zip '{}'", ines_path);
+                return RomError::BAD_ZIP;
+            }
+            self.image.resize(member.size);
+            if (!inflate(member.data, member.compressed_size, self.image.data(), self.image.size())) {
+                mu::log_error("corrupt .nes in zip '{}'", ines_path);
+                return RomError::BAD_ZIP;
+            }
+            mapped_file_close(self.file);
+            data = self.image.data();
+        } else {
+            mu::log_error("zip '{}' uses compression method {}, only deflate is supported", ines_path, member.method);
+            return RomError::BAD_ZIP;
+        }
+        size = member.size;
+
+        if (crc32(data, size) != member.crc) {
+            mu::log_error("corrupt .nes in zip '{}'", ines_path);
+            return RomError::BAD_ZIP;
+        }
     }
 
-    self.prg.clear();
-    self.prg.insert(self.prg.end(), prg_ptr, prg_ptr+prg_size);
+    if (auto error = _rom_patch(self, ines_path, data, size); error != RomError::NONE) {
+        return error;
+    }
 
-    // copy CHR
-    uint8_t* chr_ptr = prg_ptr+prg_size;
+    if (auto error = rom_parse_ines(self, data, size, db); error != RomError::NONE) {
+        mu::log_error("'{}': {}", ines_path, rom_error_str(error));
+        return error;
+    }
+    if (self.header.flags6.bits.has_trainer) {
+        mu::log_warning("emulator doesnt support trainers, ignoring trainer");
+    }
 
-    auto chr_size = rom_get_chr_rom_size(self);
-    if (chr_ptr+chr_size > buffer+file.size()) {
-        mu::panic("no CHR ROM");
+    if (!mapper_supported(rom_get_mapper_number(self))) {
+        mu::log_error("'{}': mapper {} isn't supported", ines_path, rom_get_mapper_number(self));
+        return RomError::UNSUPPORTED_MAPPER;
+    }
+    if (self.prg.empty()) {
+        mu::log_error("'{}': no PRG ROM", ines_path);
+        return RomError::NO_PRG;
+    }
+    if (self.header.num_chrs == 0) {
+        rom_set_chr(self, mu::Vec<uint8_t>(8*1024, 0)); // CHR RAM
     }
 
-    self.chr.clear();
-    self.chr.insert(self.chr.end(), chr_ptr, chr_ptr+chr_size);
+    rom_alloc_prg_ram(self, sav_path);
+    return RomError::NONE;
+}
 
-    const bool valid_mmc0_rom = rom_get_mapper_number(self) == 0 &&
-        (self.prg.size() % (16*1024) == 0) &&
-        (self.chr.size() == (8*1024));
-    if (!valid_mmc0_rom) {
-        mu::panic("only supports MMC0");
+RomError rom_from_ines_file(ROM& self, const mu::Str& ines_path, const RomDb* db, const mu::Str& sav_path) {
+    rom_free(self);
+    if (auto error = _rom_load_ines_file(self, ines_path, db, sav_path); error != RomError::NONE) {
+        rom_free(self); // nothing half loaded is left behind
+        return error;
     }
 
     if (self.header.flags7.bits.has_play_choice) {
         mu::log_warning("emulator doesnt support PlayChoice, ignoring PlayChoice");
     }
+    mu::log_debug("rom crc32 = {:08x}", self.crc);
     mu::log_debug("rom mapper num = {}", rom_get_mapper_number(self));
     mu::log_debug("iNES version = {}", self.header.flags7.bits.nes2format == 2? 2:1);
     mu::log_debug("rom num of PRG roms = {}", self.header.num_prgs);
@@ -95,25 +217,88 @@ void rom_from_ines_file(ROM& self, const mu::Str& ines_path) {
             mu::log_debug("rom mirroring is vertical");
         }
     } else {
-        mu::log_warning("rom ignores mirroring");
+        mu::log_debug("rom uses four-screen vram");
     }
     mu::log_debug("loaded rom from {}", ines_path);
+    return RomError::NONE;
+}
+
+mu::Str rom_sav_path(const mu::Str& ines_path) {
+    const auto path = std::filesystem::path(ines_path.c_str()).replace_extension(".sav").string();
+    return mu::Str(path.begin(), path.end());
+}
+
+void rom_alloc_prg_ram(ROM& self, const mu::Str& sav_path) {
+    rom_flush_sav(self);
+    mapped_file_close(self.sav);
+    self.prg_ram_buf = {};
+    self.prg_ram = {};
+    if (!mapper_has_prg_ram(self)) {
+        return;
+    }
+
+    const size_t size = region_size(SRAM);
+    if (self.header.flags6.bits.has_battery_backed_prgram && !sav_path.empty()) {
+        if (mapped_file_open_shared(self.sav, sav_path.c_str(), size)) {
+            self.prg_ram = {self.sav.data, size};
+            mu::log_debug("battery ram mapped from {}", sav_path);
+            return;
+        }
+        mu::log_warning("failed to map '{}', battery ram won't be saved", sav_path);
+    }
+
+    self.prg_ram_buf.resize(size, 0);
+    self.prg_ram = self.prg_ram_buf;
+}
+
+void rom_flush_sav(ROM& self) {
+    mapped_file_flush(self.sav);
+}
+
+void rom_free(ROM& self) {
+    mapped_file_close(self.file);
+    rom_flush_sav(self);
+    mapped_file_close(self.sav);
+    self.prg_ram_buf = {};
+    self.prg_ram = {};
+    self.image = {};
+    self.prg_buf = {};
+    self.chr_buf = {};
+    self.prg = {};
+    self.chr = {};
+}
+
+void rom_set_prg(ROM& self, mu::Vec<uint8_t> prg) {
+    self.prg_buf = std::move(prg);
+    self.prg = self.prg_buf;
+}
+
+void rom_set_chr(ROM& self, mu::Vec<uint8_t> chr) {
+    self.chr_buf = std::move(chr);
+    self.chr = self.chr_buf;
 }
 
 bool rom_read(ROM& self, uint16_t addr, uint8_t& data) {
-    if (self.prg.size() > 0 && region_contains(PRG_REGION, addr)) {
-        data = self.prg[(addr - PRG_ROM_LOW.start) % self.prg.size()];
+    if (addr >= PRG_REGION.start) {
+        if (self.prg.empty()) {
+            return false;
+        }
+        data = self.prg_banks[(addr >> 13) & 0b11][addr & 0x1FFF];
+        return true;
+    }
 
+    if (!self.prg_ram.empty() && region_contains(SRAM, addr)) {
+        data = self.prg_ram[addr - SRAM.start];
         return true;
     }
 
     return false;
 }
 
+// prg rom writes are mapper registers, see mapper_write
 bool rom_write(ROM& self, uint16_t addr, uint8_t data) {
-    if (self.prg.size() > 0 && region_contains(PRG_REGION, addr)) {
-        self.prg[(addr - PRG_ROM_LOW.start) % self.prg.size()] = data;
-
+    if (!self.prg_ram.empty() && region_contains(SRAM, addr)) {
+        self.prg_ram[addr - SRAM.start] = data;
         return true;
     }
 
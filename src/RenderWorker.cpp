@@ -0,0 +1,170 @@
+#include "Console.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+struct RenderWorker {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool quit;
+
+    // emulation thread side
+    PPU* ppu;
+    mu::Vec<PPUCommand> recording;
+
+    // handed between the threads, guarded by mutex
+    mu::Vec<PPUCommand> submitted;
+    bool has_submitted;
+    bool submitted_render;
+    ScreenBuf done;
+    bool has_done;
+
+    // worker side, a copy of the PPU that lags one frame behind
+    PPU shadow;
+    const uint8_t* chr_rom;
+    mu::Vec<uint8_t> chr_ram; // own copy, the console keeps writing to the real one meanwhile
+    ScreenBuf back;
+};
+
+static uint8_t* _render_worker_chr_bank(RenderWorker& self, uint32_t offset) {
+    if (!self.shadow.chr_ram) {
+        return (uint8_t*) self.chr_rom + offset;
+    }
+    return &self.chr_ram[offset];
+}
+
+static void _render_worker_apply(RenderWorker& self, const PPUCommand& cmd) {
+    uint8_t ignored;
+    switch (cmd.kind) {
+    case PPUCommand::Kind::WRITE:
+        ppu_write(self.shadow, cmd.addr, cmd.data);
+        break;
+    case PPUCommand::Kind::READ:
+        ppu_read(self.shadow, cmd.addr, ignored);
+        break;
+    case PPUCommand::Kind::MIRRORING:
+        ppu_set_mirroring(self.shadow, (Mirroring) cmd.data);
+        break;
+    case PPUCommand::Kind::MAP_CHR:
+        if (cmd.chr_offset != PPUCommand::UNMAPPED) {
+            ppu_map_chr(self.shadow, cmd.data, _render_worker_chr_bank(self, cmd.chr_offset));
+        }
+        break;
+    }
+}
+
+// step the copy through one frame dot by dot, applying each access at the dot it was
+// recorded at, so scroll splits and mid-frame bank or palette changes land on the same scanline
+static void _render_worker_replay(RenderWorker& self, const mu::Vec<PPUCommand>& commands, bool render) {
+    auto& ppu = self.shadow;
+    const auto frame = ppu.frames;
+
+    size_t next = 0;
+    while (ppu.frames == frame) {
+        for (; next < commands.size() && commands[next].row == ppu.row && commands[next].col == ppu.col; next++) {
+            _render_worker_apply(self, commands[next]);
+        }
+
+        const bool line_start = ppu.row < self.back.h && ppu.col == 0;
+        const uint16_t line = ppu.row;
+        ppu_clock(ppu);
+        if (line_start && render) {
+            ppu_render_scanline(ppu, line, self.back);
+        }
+    }
+
+    for (; next < commands.size(); next++) {
+        _render_worker_apply(self, commands[next]);
+    }
+}
+
+static void _render_worker_loop(RenderWorker& self) {
+    mu::Vec<PPUCommand> commands;
+    bool render;
+    while (true) {
+        {
+            std::unique_lock lock(self.mutex);
+            self.cv.wait(lock, [&] { return self.quit || self.has_submitted; });
+            if (self.quit) {
+                return;
+            }
+            std::swap(commands, self.submitted);
+            render = self.submitted_render;
+            self.has_submitted = false;
+        }
+        self.cv.notify_all();
+
+        _render_worker_replay(self, commands, render);
+        commands.clear();
+
+        if (render) {
+            std::lock_guard lock(self.mutex);
+            std::swap(self.back, self.done);
+            self.has_done = true;
+        }
+    }
+}
+
+RenderWorker* render_worker_new(PPU& ppu) {
+    auto self = new RenderWorker {};
+    self->ppu = &ppu;
+    self->done = screenbuf_new(Config::resolution.w, Config::resolution.h);
+    self->back = screenbuf_new(Config::resolution.w, Config::resolution.h);
+
+    self->shadow = ppu;
+    self->shadow.console = nullptr;
+    self->shadow.command_log = nullptr;
+    ppu_set_mirroring(self->shadow, ppu.mirroring);
+
+    const auto& chr = ppu.console->rom.chr;
+    self->chr_rom = chr.data();
+    if (ppu.chr_ram) {
+        self->chr_ram.assign(chr.begin(), chr.end());
+        for (uint8_t slot = 0; slot < ppu.chr_banks.size(); slot++) {
+            const uint8_t* bank = ppu.chr_banks[slot];
+            if (bank >= chr.data() && bank < chr.data() + chr.size()) {
+                self->shadow.chr_banks[slot] = &self->chr_ram[bank - chr.data()];
+            }
+        }
+    }
+
+    ppu.command_log = &self->recording;
+    self->thread = std::thread(_render_worker_loop, std::ref(*self));
+    return self;
+}
+
+void render_worker_free(RenderWorker* self) {
+    {
+        std::lock_guard lock(self->mutex);
+        self->quit = true;
+    }
+    self->cv.notify_all();
+    self->thread.join();
+
+    self->ppu->command_log = nullptr;
+    delete self;
+}
+
+void render_worker_submit(RenderWorker& self, bool render) {
+    {
+        std::unique_lock lock(self.mutex);
+        self.cv.wait(lock, [&] { return !self.has_submitted; });
+        std::swap(self.recording, self.submitted);
+        self.submitted_render = render;
+        self.has_submitted = true;
+    }
+    self.cv.notify_all();
+    self.recording.clear();
+}
+
+bool render_worker_present(RenderWorker& self, ScreenBuf& buf) {
+    std::lock_guard lock(self.mutex);
+    if (!self.has_done) {
+        return false;
+    }
+    std::swap(self.done.pixels, buf.pixels);
+    self.has_done = false;
+    return true;
+}
@@ -0,0 +1,225 @@
+#include "Console.h"
+
+// packed frame: repeated [zeros varint][literals varint][literal bytes], over state ^ base
+// a run needs this many equal bytes to be worth ending a literal for
+static constexpr size_t MIN_ZERO_RUN = 4;
+
+static void _put_varint(mu::Vec<uint8_t>& out, size_t& at, size_t v) {
+    for (; v >= 0x80; v >>= 7) {
+        out[at++] = uint8_t(v) | 0x80;
+    }
+    out[at++] = uint8_t(v);
+}
+
+static size_t _get_varint(const uint8_t*& p) {
+    size_t v = 0;
+    for (int shift = 0;; shift += 7) {
+        const uint8_t b = *p++;
+        v |= size_t(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return v;
+        }
+    }
+}
+
+static uint8_t _base_at(const uint8_t* base, size_t i) {
+    return base ? base[i] : 0;
+}
+
+// base is null for keyframes, which are then packed against zeros
+static void _rewind_pack(const uint8_t* state, const uint8_t* base, size_t size, mu::Vec<uint8_t>& out) {
+    // worst case is a literal broken by every short zero run
+    out.resize(size + size / MIN_ZERO_RUN * 4 + 16);
+    size_t at = 0;
+
+    size_t i = 0;
+    while (i < size) {
+        // skip equal bytes, 8 at a time while they last
+        const size_t zeros_start = i;
+        if (base) {
+            for (; i + 8 <= size; i += 8) {
+                uint64_t a, b;
+                memcpy(&a, state + i, 8);
+                memcpy(&b, base + i, 8);
+                if (a != b) {
+                    break;
+                }
+            }
+        } else {
+            for (; i + 8 <= size; i += 8) {
+                uint64_t a;
+                memcpy(&a, state + i, 8);
+                if (a != 0) {
+                    break;
+                }
+            }
+        }
+        for (; i < size && state[i] == _base_at(base, i); i++) {}
+
+        // literal lasts until the next run of equal bytes long enough
+        const size_t literal_start = i;
+        size_t run = 0;
+        for (; i < size && run < MIN_ZERO_RUN; i++) {
+            run = state[i] == _base_at(base, i) ? run + 1 : 0;
+        }
+        if (run == MIN_ZERO_RUN) {
+            i -= run;
+        }
+
+        _put_varint(out, at, literal_start - zeros_start);
+        _put_varint(out, at, i - literal_start);
+        for (size_t j = literal_start; j < i; j++) {
+            out[at++] = state[j] ^ _base_at(base, j);
+        }
+    }
+
+    out.resize(at);
+}
+
+static void _rewind_unpack(const uint8_t* packed, size_t packed_size, const uint8_t* base, uint8_t* state, size_t size) {
+    const uint8_t* p = packed;
+    const uint8_t* end = packed + packed_size;
+
+    size_t i = 0;
+    while (p < end) {
+        const size_t zeros = _get_varint(p);
+        const size_t literals = _get_varint(p);
+        if (base) {
+            memcpy(state + i, base + i, zeros);
+        } else {
+            memset(state + i, 0, zeros);
+        }
+        i += zeros;
+
+        for (size_t j = 0; j < literals; j++, i++) {
+            state[i] = *p++ ^ _base_at(base, i);
+        }
+    }
+    mu_assert(i == size);
+}
+
+static RewindFrame& _rewind_frame(Rewind& self, size_t i) {
+    return self.frames[(self.first + i) % self.frames.size()];
+}
+
+static void _rewind_drop_oldest(Rewind& self) {
+    self.first = (self.first + 1) % self.frames.size();
+    self.count--;
+
+    // deltas are useless without the keyframe before them
+    while (self.count > 0 && !_rewind_frame(self, 0).keyframe) {
+        self.first = (self.first + 1) % self.frames.size();
+        self.count--;
+    }
+}
+
+// make room for [offset, offset + size) in the ring, the oldest frames are the ones right after head
+static void _rewind_evict(Rewind& self, size_t offset, size_t size) {
+    while (self.count > 0) {
+        const auto& oldest = _rewind_frame(self, 0);
+        if (oldest.offset >= offset + size || oldest.offset + oldest.size <= offset) {
+            break;
+        }
+        _rewind_drop_oldest(self);
+    }
+}
+
+// unpack the newest keyframe into self.keyframe, and count the frames after it
+static void _rewind_reload_keyframe(Rewind& self) {
+    self.keyframe.clear();
+    self.since_keyframe = 0;
+
+    for (size_t i = self.count; i-- > 0;) {
+        const auto& frame = _rewind_frame(self, i);
+        if (frame.keyframe) {
+            self.keyframe.resize(frame.state_size);
+            _rewind_unpack(&self.ring[frame.offset], frame.size, nullptr, self.keyframe.data(), frame.state_size);
+            return;
+        }
+        self.since_keyframe++;
+    }
+}
+
+Rewind rewind_new(size_t bytes, size_t max_frames, int keyframe_interval) {
+    return Rewind {
+        .ring = mu::Vec<uint8_t>(bytes, 0),
+        .frames = mu::Vec<RewindFrame>(max_frames, RewindFrame{}),
+        .keyframe_interval = keyframe_interval,
+    };
+}
+
+void rewind_clear(Rewind& self) {
+    self.head = 0;
+    self.first = 0;
+    self.count = 0;
+    self.keyframe.clear();
+    self.since_keyframe = 0;
+}
+
+void rewind_push(Rewind& self, const Console& console) {
+    console_save_state(console, self.state);
+
+    bool keyframe = self.keyframe.size() != self.state.size() || self.since_keyframe >= self.keyframe_interval;
+    if (self.count == self.frames.size()) {
+        _rewind_drop_oldest(self);
+    }
+
+    while (true) {
+        _rewind_pack(self.state.data(), keyframe ? nullptr : self.keyframe.data(), self.state.size(), self.packed);
+        if (self.packed.size() > self.ring.size()) {
+            mu::log_error("rewind ring of {} bytes can't hold a frame of {} bytes", self.ring.size(), self.packed.size());
+            return;
+        }
+
+        // frames never wrap around the end of the ring, the space left there is skipped
+        if (self.head + self.packed.size() > self.ring.size()) {
+            _rewind_evict(self, self.head, self.ring.size() - self.head);
+            self.head = 0;
+        }
+        _rewind_evict(self, self.head, self.packed.size());
+
+        // the keyframe this delta was against got evicted, only when the ring holds very few frames,
+        // it's packed again on its own and placed again for its bigger size
+        if (keyframe || self.count > 0) {
+            break;
+        }
+        keyframe = true;
+    }
+
+    memcpy(&self.ring[self.head], self.packed.data(), self.packed.size());
+    self.count++;
+    _rewind_frame(self, self.count - 1) = RewindFrame {
+        .offset = self.head,
+        .size = uint32_t(self.packed.size()),
+        .state_size = uint32_t(self.state.size()),
+        .keyframe = keyframe,
+    };
+    self.head += self.packed.size();
+
+    if (keyframe) {
+        std::swap(self.keyframe, self.state);
+        self.since_keyframe = 0;
+    } else {
+        self.since_keyframe++;
+    }
+}
+
+bool rewind_pop(Rewind& self, Console& console) {
+    if (self.count == 0) {
+        return false;
+    }
+
+    const auto frame = _rewind_frame(self, self.count - 1);
+    self.state.resize(frame.state_size);
+    _rewind_unpack(&self.ring[frame.offset], frame.size, frame.keyframe ? nullptr : self.keyframe.data(), self.state.data(), frame.state_size);
+
+    self.count--;
+    self.head = frame.offset;
+    if (frame.keyframe) {
+        _rewind_reload_keyframe(self);
+    } else {
+        self.since_keyframe--;
+    }
+
+    return console_load_state(console, self.state.data(), self.state.size());
+}
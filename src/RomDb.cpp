@@ -0,0 +1,161 @@
+#include "Console.h"
+
+#include <algorithm>
+
+// file: RomDbHeader then the entries sorted by crc, mapped and binary searched in place
+struct RomDbHeader {
+    uint8_t magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t _padding;
+};
+
+static_assert(sizeof(RomDbHeader) == 16);
+
+constexpr uint8_t ROMDB_MAGIC[4] = {'N', 'E', 'D', 'B'};
+constexpr uint32_t ROMDB_VERSION = 1;
+
+static bool _romdb_entry_less(const RomDbEntry& a, const RomDbEntry& b) {
+    return a.crc != b.crc ? a.crc < b.crc : a.sha1 < b.sha1;
+}
+
+bool romdb_open(RomDb& self, const char* path) {
+    romdb_close(self);
+    if (!mapped_file_open(self.file, path)) {
+        return false;
+    }
+
+    RomDbHeader header {};
+    if (self.file.size >= sizeof(header)) {
+        memcpy(&header, self.file.data, sizeof(header));
+    }
+    if (self.file.size < sizeof(header) || memcmp(header.magic, ROMDB_MAGIC, 4) != 0 || header.version != ROMDB_VERSION ||
+        self.file.size != sizeof(header) + size_t(header.count) * sizeof(RomDbEntry)) {
+        mu::log_error("'{}' isn't a version {} rom database", path, ROMDB_VERSION);
+        romdb_close(self);
+        return false;
+    }
+
+    self.entries = {(const RomDbEntry*) (self.file.data + sizeof(header)), header.count};
+    return true;
+}
+
+void romdb_close(RomDb& self) {
+    mapped_file_close(self.file);
+    self.entries = {};
+}
+
+SHA1Digest rom_sha1(const ROM& rom) {
+    auto sha1 = sha1_new();
+    sha1_update(sha1, rom.prg.data(), rom.prg.size());
+    sha1_update(sha1, rom.chr.data(), rom.chr.size());
+    return sha1_final(sha1);
+}
+
+const RomDbEntry* romdb_find(const RomDb& self, const ROM& rom, const SHA1Digest* sha1) {
+    auto it = std::lower_bound(self.entries.begin(), self.entries.end(), rom.crc, [](const RomDbEntry& e, uint32_t crc) {
+        return e.crc < crc;
+    });
+    if (it == self.entries.end() || it->crc != rom.crc) {
+        return nullptr;
+    }
+
+    // only hashed on a crc match, which is nearly always the right rom
+    const auto digest = sha1 ? *sha1 : rom_sha1(rom);
+
+    for (; it != self.entries.end() && it->crc == rom.crc; it++) {
+        if (it->sha1 == digest) {
+            return &*it;
+        }
+    }
+    return nullptr;
+}
+
+bool romdb_write(const char* path, mu::Vec<RomDbEntry>& entries) {
+    std::sort(entries.begin(), entries.end(), _romdb_entry_less);
+
+    auto file = fopen(path, "wb");
+    if (file == nullptr) {
+        mu::log_error("failed to open '{}' for writing", path);
+        return false;
+    }
+    mu_defer(fclose(file));
+
+    RomDbHeader header {
+        .version = ROMDB_VERSION,
+        .count = uint32_t(entries.size()),
+    };
+    memcpy(header.magic, ROMDB_MAGIC, 4);
+
+    return fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(entries.data(), sizeof(RomDbEntry), entries.size(), file) == entries.size();
+}
+
+static bool _parse_hex(const char* s, uint8_t* out, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        unsigned byte;
+        if (sscanf(s + i*2, "%2x", &byte) != 1) {
+            return false;
+        }
+        out[i] = byte;
+    }
+    return true;
+}
+
+bool romdb_from_csv(const char* csv_path, const char* out_path) {
+    auto file = fopen(csv_path, "r");
+    if (file == nullptr) {
+        mu::log_error("failed to open '{}' for reading", csv_path);
+        return false;
+    }
+    mu_defer(fclose(file));
+
+    mu::Vec<RomDbEntry> entries;
+    char line[256];
+    for (int line_num = 1; fgets(line, sizeof(line), file); line_num++) {
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+            continue;
+        }
+
+        RomDbEntry entry {};
+        char sha1[41] {}, mirroring[8] {}, region[8] {};
+        unsigned mapper, battery;
+        if (sscanf(line, "%x,%40[0-9a-fA-F],%u,%7[^,],%u,%7[a-z]", &entry.crc, sha1, &mapper, mirroring, &battery, region) != 6 ||
+            !_parse_hex(sha1, entry.sha1.data(), entry.sha1.size())) {
+            mu::log_error("{}:{}: expected crc32,sha1,mapper,h|v|4,battery,ntsc|pal|dendy", csv_path, line_num);
+            return false;
+        }
+
+        entry.mapper = mapper;
+        entry.battery = battery != 0;
+        entry.mirroring = mirroring[0] == 'v' ? Mirroring::VERTICAL : mirroring[0] == '4' ? Mirroring::FOUR_SCREEN : Mirroring::HORIZONTAL;
+        entry.tv_system = region == mu::StrView("pal") ? TVSystem::PAL : region == mu::StrView("dendy") ? TVSystem::DENDY : TVSystem::NTSC;
+        entries.push_back(entry);
+    }
+
+    return romdb_write(out_path, entries);
+}
+
+void rom_apply_db_entry(ROM& self, const RomDbEntry& entry) {
+    auto& header = self.header;
+
+    // iNES has no field for dendy, and old dumpers left garbage in bytes 8-15, so it becomes a NES 2.0 header
+    if (header.flags7.bits.nes2format != 2) {
+        header._padding8 = 0;
+        header.flags9 = 0;
+        header._padding10[0] = header._padding10[1] = 0;
+        header.timing = 0;
+        header._padding13[0] = header._padding13[1] = header._padding13[2] = 0;
+        header.flags7.bits.nes2format = 2;
+    }
+
+    header.flags6.bits.lower_mapper_num = entry.mapper & 0xF;
+    header.flags7.bits.upper_mapper_num = (entry.mapper >> 4) & 0xF;
+
+    header.flags6.bits.ignore_mirroring_control = entry.mirroring == Mirroring::FOUR_SCREEN;
+    header.flags6.bits.mirroring = entry.mirroring == Mirroring::VERTICAL;
+    header.flags6.bits.has_battery_backed_prgram = entry.battery;
+
+    constexpr uint8_t TIMINGS[] = {0, 1, 3}; // NTSC, PAL, Dendy
+    header.timing = (header.timing & ~0b11) | TIMINGS[uint8_t(entry.tv_system)];
+}
@@ -0,0 +1,230 @@
+#include "Console.h"
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// file: RomIndexHeader, the entries, then the paths they point into
+struct RomIndexHeader {
+    uint8_t magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t paths_size;
+};
+
+static_assert(sizeof(RomIndexHeader) == 16);
+
+constexpr uint8_t ROM_INDEX_MAGIC[4] = {'N', 'E', 'S', 'I'};
+constexpr uint32_t ROM_INDEX_VERSION = 1;
+
+static mu::StrView _rom_index_path(const RomIndex& self, const RomIndexEntry& entry) {
+    return mu::StrView(self.paths.data() + entry.path_offset, entry.path_size);
+}
+
+static void _rom_index_hash(RomIndexEntry& entry, const std::filesystem::path& path, const RomDb* db) {
+    MappedFile file {};
+    if (!mapped_file_open(file, path.string().c_str())) {
+        return;
+    }
+    mu_defer(mapped_file_close(file));
+
+    ROM rom {};
+    if (rom_parse_ines(rom, file.data, file.size) != RomError::NONE) {
+        return;
+    }
+
+    // hashed once, for the entry and the database lookup both
+    entry.sha1 = rom_sha1(rom);
+    if (db) {
+        if (auto known = romdb_find(*db, rom, &entry.sha1)) {
+            rom_apply_db_entry(rom, *known);
+        }
+    }
+
+    entry.crc = rom.crc;
+    entry.prg_size = rom.prg.size();
+    entry.chr_size = rom.chr.size();
+    entry.mapper = rom_get_mapper_number(rom);
+    entry.tv_system = rom_get_tv_system(rom);
+    entry.valid = true;
+}
+
+// each worker owns a range of the work and takes from its front, an idle one steals
+// the back half of the fullest range, so big roms piling up in one range don't stall it
+struct ScanRange {
+    std::mutex mutex;
+    size_t begin, end;
+};
+
+static bool _scan_range_take(ScanRange& self, size_t& i) {
+    std::lock_guard lock(self.mutex);
+    if (self.begin == self.end) {
+        return false;
+    }
+    i = self.begin++;
+    return true;
+}
+
+static bool _scan_range_steal(mu::Vec<ScanRange>& ranges, ScanRange& thief) {
+    while (true) {
+        ScanRange* victim = nullptr;
+        size_t most = 0;
+        for (auto& range : ranges) {
+            std::lock_guard lock(range.mutex);
+            if (range.end - range.begin > most) {
+                most = range.end - range.begin;
+                victim = &range;
+            }
+        }
+        if (victim == nullptr) {
+            return false;
+        }
+
+        std::scoped_lock lock(victim->mutex, thief.mutex);
+        const size_t left = victim->end - victim->begin;
+        if (left == 0) {
+            continue; // taken meanwhile, look again
+        }
+        const size_t n = (left + 1) / 2;
+        thief.begin = victim->end - n;
+        thief.end = victim->end;
+        victim->end -= n;
+        return true;
+    }
+}
+
+size_t rom_index_scan(RomIndex& self, const char* dir, const RomDb* db, int threads) {
+    namespace fs = std::filesystem;
+
+    // previous entries by path, reused while the file's mtime and size are the same
+    std::unordered_map<mu::StrView, const RomIndexEntry*> old;
+    for (const auto& entry : self.entries) {
+        old[_rom_index_path(self, entry)] = &entry;
+    }
+
+    RomIndex index {};
+    mu::Vec<fs::path> paths;
+    mu::Vec<size_t> work; // entries to hash
+
+    std::error_code error;
+    for (auto it = fs::recursive_directory_iterator(dir, fs::directory_options::skip_permission_denied, error);
+         it != fs::recursive_directory_iterator(); it.increment(error)) {
+        if (error) {
+            mu::log_warning("failed to scan '{}': {}", dir, error.message());
+            break;
+        }
+
+        auto ext = it->path().extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return (char) tolower(c); });
+        if (!it->is_regular_file(error) || ext != ".nes") {
+            continue;
+        }
+
+        const auto relative = it->path().lexically_relative(dir).generic_string();
+        RomIndexEntry entry {
+            .mtime = (int64_t) it->last_write_time(error).time_since_epoch().count(),
+            .file_size = (uint64_t) it->file_size(error),
+            .path_offset = uint32_t(index.paths.size()),
+            .path_size = uint32_t(relative.size()),
+        };
+        index.paths.insert(index.paths.end(), relative.begin(), relative.end());
+
+        auto found = old.find(relative);
+        if (found != old.end() && found->second->mtime == entry.mtime && found->second->file_size == entry.file_size) {
+            const auto path_offset = entry.path_offset;
+            entry = *found->second;
+            entry.path_offset = path_offset;
+        } else {
+            work.push_back(index.entries.size());
+        }
+        index.entries.push_back(entry);
+        paths.push_back(it->path());
+    }
+
+    // hash what's new or changed on all the cores
+    threads = std::max(1, std::min<int>(threads, work.size()));
+    mu::Vec<ScanRange> ranges(threads);
+    for (int t = 0; t < threads; t++) {
+        ranges[t].begin = work.size() * t / threads;
+        ranges[t].end = work.size() * (t + 1) / threads;
+    }
+
+    auto worker = [&](int t) {
+        size_t i;
+        while (_scan_range_take(ranges[t], i) || (_scan_range_steal(ranges, ranges[t]) && _scan_range_take(ranges[t], i))) {
+            const size_t e = work[i];
+            _rom_index_hash(index.entries[e], paths[e], db);
+        }
+    };
+
+    mu::Vec<std::thread> pool;
+    for (int t = 1; t < threads; t++) {
+        pool.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto& thread : pool) {
+        thread.join();
+    }
+
+    self = std::move(index);
+    return work.size();
+}
+
+bool rom_index_load(RomIndex& self, const char* path) {
+    self = {};
+
+    MappedFile file {};
+    if (!mapped_file_open(file, path)) {
+        return false;
+    }
+    mu_defer(mapped_file_close(file));
+
+    RomIndexHeader header {};
+    if (file.size >= sizeof(header)) {
+        memcpy(&header, file.data, sizeof(header));
+    }
+    const size_t entries_size = size_t(header.count) * sizeof(RomIndexEntry);
+    if (file.size < sizeof(header) || memcmp(header.magic, ROM_INDEX_MAGIC, 4) != 0 || header.version != ROM_INDEX_VERSION ||
+        file.size != sizeof(header) + entries_size + header.paths_size) {
+        mu::log_error("'{}' isn't a version {} rom index", path, ROM_INDEX_VERSION);
+        return false;
+    }
+
+    const uint8_t* p = file.data + sizeof(header);
+    self.entries.resize(header.count);
+    memcpy(self.entries.data(), p, entries_size);
+    self.paths.resize(header.paths_size);
+    memcpy(self.paths.data(), p + entries_size, header.paths_size);
+
+    for (const auto& entry : self.entries) {
+        if (size_t(entry.path_offset) + entry.path_size > self.paths.size()) {
+            mu::log_error("'{}' has a path out of bounds", path);
+            self = {};
+            return false;
+        }
+    }
+    return true;
+}
+
+bool rom_index_save(const RomIndex& self, const char* path) {
+    auto file = fopen(path, "wb");
+    if (file == nullptr) {
+        mu::log_error("failed to open '{}' for writing", path);
+        return false;
+    }
+    mu_defer(fclose(file));
+
+    RomIndexHeader header {
+        .version = ROM_INDEX_VERSION,
+        .count = uint32_t(self.entries.size()),
+        .paths_size = uint32_t(self.paths.size()),
+    };
+    memcpy(header.magic, ROM_INDEX_MAGIC, 4);
+
+    return fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(self.entries.data(), sizeof(RomIndexEntry), self.entries.size(), file) == self.entries.size() &&
+           fwrite(self.paths.data(), 1, self.paths.size(), file) == self.paths.size();
+}
@@ -0,0 +1,364 @@
+#include "Console.h"
+
+#include <algorithm>
+
+// https://www.rfc-editor.org/rfc/rfc1951, https://pkware.cachefly.net/webdocs/casestudies/APPNOTE.TXT
+
+// codes up to this long are decoded with one table lookup, longer ones bit by bit
+constexpr int HUFFMAN_FAST_BITS = 10;
+constexpr int HUFFMAN_MAX_BITS = 15;
+
+struct Huffman {
+    uint16_t fast[1 << HUFFMAN_FAST_BITS]; // length << 9 | symbol, 0 when the code is longer
+    uint16_t count[HUFFMAN_MAX_BITS + 1]; // number of codes of each length
+    uint16_t symbols[288]; // ordered by code
+};
+
+// lsb first, refilled 8 bytes at a time, reading past the end feeds zeros that are checked at the end
+struct BitReader {
+    const uint8_t* p;
+    const uint8_t* end;
+    uint64_t bits;
+    int count;
+    size_t overrun; // zero bytes fed past the end
+};
+
+static void _bits_refill(BitReader& self) {
+    if (self.end - self.p >= 8) {
+        uint64_t v;
+        memcpy(&v, self.p, 8);
+        self.bits |= v << self.count;
+        const int n = (63 - self.count) / 8;
+        self.p += n;
+        self.count += n * 8;
+        return;
+    }
+    while (self.count <= 56) {
+        if (self.p < self.end) {
+            self.bits |= uint64_t(*self.p++) << self.count;
+        } else {
+            self.overrun++;
+        }
+        self.count += 8;
+    }
+}
+
+static uint32_t _bits_get(BitReader& self, int n) {
+    if (self.count < n) {
+        _bits_refill(self);
+    }
+    const uint32_t v = self.bits & ((uint64_t(1) << n) - 1);
+    self.bits >>= n;
+    self.count -= n;
+    return v;
+}
+
+static bool _huffman_build(Huffman& self, const uint8_t* lengths, int n) {
+    self = {};
+    for (int i = 0; i < n; i++) {
+        self.count[lengths[i]]++;
+    }
+    self.count[0] = 0;
+
+    // canonical codes: the first code of each length, rejecting over-subscribed sets
+    uint16_t offsets[HUFFMAN_MAX_BITS + 1];
+    uint32_t next_code[HUFFMAN_MAX_BITS + 1];
+    int left = 1;
+    uint32_t code = 0;
+    offsets[1] = 0;
+    for (int len = 1; len <= HUFFMAN_MAX_BITS; len++) {
+        left = left * 2 - self.count[len];
+        if (left < 0) {
+            return false;
+        }
+        next_code[len] = code;
+        code = (code + self.count[len]) << 1;
+        if (len < HUFFMAN_MAX_BITS) {
+            offsets[len + 1] = offsets[len] + self.count[len];
+        }
+    }
+
+    for (int sym = 0; sym < n; sym++) {
+        const int len = lengths[sym];
+        if (len == 0) {
+            continue;
+        }
+        self.symbols[offsets[len]++] = sym;
+
+        // codes are sent msb first, the table is indexed by the bits as they come
+        const uint32_t c = next_code[len]++;
+        if (len <= HUFFMAN_FAST_BITS) {
+            uint32_t reversed = 0;
+            for (int i = 0; i < len; i++) {
+                reversed |= ((c >> i) & 1) << (len - 1 - i);
+            }
+            for (uint32_t i = reversed; i < (1u << HUFFMAN_FAST_BITS); i += 1u << len) {
+                self.fast[i] = len << 9 | sym;
+            }
+        }
+    }
+    return true;
+}
+
+// -1 for a code that isn't in the table
+static int _huffman_decode(const Huffman& self, BitReader& in) {
+    if (in.count < HUFFMAN_MAX_BITS) {
+        _bits_refill(in);
+    }
+
+    const uint16_t entry = self.fast[in.bits & ((1 << HUFFMAN_FAST_BITS) - 1)];
+    if (entry) {
+        const int len = entry >> 9;
+        in.bits >>= len;
+        in.count -= len;
+        return entry & 0x1FF;
+    }
+
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len <= HUFFMAN_MAX_BITS; len++) {
+        code |= in.bits & 1;
+        in.bits >>= 1;
+        in.count--;
+
+        const int count = self.count[len];
+        if (code - first < count) {
+            return self.symbols[index + code - first];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static constexpr uint16_t LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static constexpr uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static constexpr uint16_t DIST_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static constexpr uint8_t DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static bool _inflate_block(BitReader& in, const Huffman& lit, const Huffman& dist, uint8_t* out, size_t out_size, size_t& at) {
+    while (true) {
+        const int sym = _huffman_decode(lit, in);
+        if (sym < 0) {
+            return false;
+        }
+        if (sym < 256) {
+            if (at == out_size) {
+                return false;
+            }
+            out[at++] = sym;
+            continue;
+        }
+        if (sym == 256) {
+            return true;
+        }
+
+        if (sym > 285) {
+            return false;
+        }
+        const size_t len = LENGTH_BASE[sym - 257] + _bits_get(in, LENGTH_EXTRA[sym - 257]);
+        const int dsym = _huffman_decode(dist, in);
+        if (dsym < 0 || dsym > 29) {
+            return false;
+        }
+        const size_t d = DIST_BASE[dsym] + _bits_get(in, DIST_EXTRA[dsym]);
+        if (d > at || len > out_size - at) {
+            return false;
+        }
+
+        // the source overlaps the copy when d < len, which repeats the last d bytes
+        uint8_t* dst = out + at;
+        const uint8_t* src = dst - d;
+        if (d >= len) {
+            memcpy(dst, src, len);
+        } else {
+            for (size_t i = 0; i < len; i++) {
+                dst[i] = src[i];
+            }
+        }
+        at += len;
+    }
+}
+
+static bool _inflate_dynamic_tables(BitReader& in, Huffman& lit, Huffman& dist) {
+    const int hlit = _bits_get(in, 5) + 257;
+    const int hdist = _bits_get(in, 5) + 1;
+    const int hclen = _bits_get(in, 4) + 4;
+
+    constexpr uint8_t ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    uint8_t code_lengths[19] {};
+    for (int i = 0; i < hclen; i++) {
+        code_lengths[ORDER[i]] = _bits_get(in, 3);
+    }
+    Huffman lengths_code;
+    if (!_huffman_build(lengths_code, code_lengths, 19)) {
+        return false;
+    }
+
+    // literal/length and distance lengths are one sequence, repeats can cross between them
+    uint8_t lengths[288 + 32] {};
+    for (int i = 0; i < hlit + hdist;) {
+        const int sym = _huffman_decode(lengths_code, in);
+        int repeat, value = 0;
+        if (sym < 0) {
+            return false;
+        } else if (sym < 16) {
+            lengths[i++] = sym;
+            continue;
+        } else if (sym == 16) {
+            if (i == 0) {
+                return false;
+            }
+            value = lengths[i - 1];
+            repeat = 3 + _bits_get(in, 2);
+        } else if (sym == 17) {
+            repeat = 3 + _bits_get(in, 3);
+        } else {
+            repeat = 11 + _bits_get(in, 7);
+        }
+        if (i + repeat > hlit + hdist) {
+            return false;
+        }
+        memset(lengths + i, value, repeat);
+        i += repeat;
+    }
+
+    return lengths[256] != 0 && _huffman_build(lit, lengths, hlit) && _huffman_build(dist, lengths + hlit, hdist);
+}
+
+bool inflate(const uint8_t* in_data, size_t in_size, uint8_t* out, size_t out_size) {
+    BitReader in {.p = in_data, .end = in_data + in_size};
+    Huffman lit, dist;
+    size_t at = 0;
+
+    bool last = false;
+    while (!last) {
+        last = _bits_get(in, 1);
+        const int type = _bits_get(in, 2);
+
+        if (type == 0) {
+            // stored, byte aligned, the bytes left in the bit buffer come first
+            _bits_get(in, in.count % 8);
+            const uint32_t len = _bits_get(in, 16);
+            const uint32_t nlen = _bits_get(in, 16);
+            if ((len ^ 0xFFFF) != nlen || len > out_size - at) {
+                return false;
+            }
+            uint32_t i = 0;
+            for (; i < len && in.count >= 8; i++) {
+                out[at++] = _bits_get(in, 8);
+            }
+            if (size_t(in.end - in.p) < len - i) {
+                return false;
+            }
+            memcpy(out + at, in.p, len - i);
+            in.p += len - i;
+            at += len - i;
+            if (in.count == 0) {
+                in.bits = 0; // it held bytes ahead of the ones just copied
+            }
+        } else if (type == 1) {
+            static const auto fixed = [] {
+                uint8_t lengths[288 + 30];
+                memset(lengths, 8, 144);
+                memset(lengths + 144, 9, 112);
+                memset(lengths + 256, 7, 24);
+                memset(lengths + 280, 8, 8);
+                memset(lengths + 288, 5, 30);
+                mu::Arr<Huffman, 2> tables;
+                _huffman_build(tables[0], lengths, 288);
+                _huffman_build(tables[1], lengths + 288, 30);
+                return tables;
+            }();
+            if (!_inflate_block(in, fixed[0], fixed[1], out, out_size, at)) {
+                return false;
+            }
+        } else if (type == 2) {
+            if (!_inflate_dynamic_tables(in, lit, dist) || !_inflate_block(in, lit, dist, out, out_size, at)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+
+    // the zeros fed past the end must not have been used
+    return at == out_size && in.overrun * 8 <= size_t(in.count);
+}
+
+static uint16_t _le16(const uint8_t* p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t _le32(const uint8_t* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24;
+}
+
+bool zip_is(const uint8_t* data, size_t size) {
+    return size >= 4 && _le32(data) == 0x04034b50;
+}
+
+bool zip_find(uint8_t* zip, size_t size, mu::StrView ext, ZipMember& member) {
+    // end of central directory, before a comment of up to 64 KB
+    constexpr size_t EOCD_SIZE = 22;
+    if (size < EOCD_SIZE) {
+        return false;
+    }
+    const uint8_t* eocd = nullptr;
+    for (size_t i = size - EOCD_SIZE;; i--) {
+        if (_le32(zip + i) == 0x06054b50) {
+            eocd = zip + i;
+            break;
+        }
+        if (i == 0 || size - i > EOCD_SIZE + 0xFFFF) {
+            return false;
+        }
+    }
+
+    const uint16_t count = _le16(eocd + 10);
+    size_t at = _le32(eocd + 16);
+    for (uint16_t n = 0; n < count; n++) {
+        constexpr size_t CDH_SIZE = 46;
+        if (at + CDH_SIZE > size || _le32(zip + at) != 0x02014b50) {
+            return false;
+        }
+        const uint8_t* cdh = zip + at;
+        const uint16_t name_size = _le16(cdh + 28);
+        at += CDH_SIZE + name_size + _le16(cdh + 30) + _le16(cdh + 32);
+        if (at > size) {
+            return false;
+        }
+
+        // case insensitive extension
+        const mu::StrView name((const char*) cdh + CDH_SIZE, name_size);
+        if (name.size() < ext.size() || !std::equal(ext.begin(), ext.end(), name.end() - ext.size(), [](char a, char b) {
+            return tolower(a) == tolower(b);
+        })) {
+            continue;
+        }
+
+        // encrypted and zip64 members aren't supported
+        const uint16_t flags = _le16(cdh + 8);
+        member.method = _le16(cdh + 10);
+        member.crc = _le32(cdh + 16);
+        member.compressed_size = _le32(cdh + 20);
+        member.size = _le32(cdh + 24);
+        const size_t local = _le32(cdh + 42);
+        if ((flags & 1) || member.compressed_size == 0xFFFFFFFF || member.size == 0xFFFFFFFF) {
+            return false;
+        }
+
+        // the data is after the local header, its name and extra fields can differ from the central ones
+        constexpr size_t LFH_SIZE = 30;
+        if (local + LFH_SIZE > size || _le32(zip + local) != 0x04034b50) {
+            return false;
+        }
+        const size_t data = local + LFH_SIZE + _le16(zip + local + 26) + _le16(zip + local + 28);
+        if (data > size || member.compressed_size > size - data) {
+            return false;
+        }
+        member.data = zip + data;
+        return true;
+    }
+    return false;
+}
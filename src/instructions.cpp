@@ -612,37 +612,37 @@ const InstructionSet instruction_set{
     Instruction{_DEF(ROR), AddressMode::AbsoluteX,       7, 0},
     Instruction{_DEF(RRA), AddressMode::AbsoluteX,       7, 0},
     Instruction{_DEF(NOP), AddressMode::Immediate,       2, 0},
-    Instruction{_DEF(STA), AddressMode::IndexedIndirect, 6, 0},
+    Instruction{_DEF(STA), AddressMode::IndexedIndirect, 6, 0, 1},
     Instruction{_DEF(NOP), AddressMode::Immediate,       2, 0},
-    Instruction{_DEF(SAX), AddressMode::IndexedIndirect, 6, 0},
-    Instruction{_DEF(STY), AddressMode::ZeroPage,        3, 0},
-    Instruction{_DEF(STA), AddressMode::ZeroPage,        3, 0},
-    Instruction{_DEF(STX), AddressMode::ZeroPage,        3, 0},
-    Instruction{_DEF(SAX), AddressMode::ZeroPage,        3, 0},
+    Instruction{_DEF(SAX), AddressMode::IndexedIndirect, 6, 0, 1},
+    Instruction{_DEF(STY), AddressMode::ZeroPage,        3, 0, 1},
+    Instruction{_DEF(STA), AddressMode::ZeroPage,        3, 0, 1},
+    Instruction{_DEF(STX), AddressMode::ZeroPage,        3, 0, 1},
+    Instruction{_DEF(SAX), AddressMode::ZeroPage,        3, 0, 1},
     Instruction{_DEF(DEY), AddressMode::Implicit,        2, 0},
     Instruction{_DEF(NOP), AddressMode::Immediate,       2, 0},
     Instruction{_DEF(TXA), AddressMode::Implicit,        2, 0},
     Instruction{_DEF(XAA), AddressMode::Immediate,       2, 0},
-    Instruction{_DEF(STY), AddressMode::Absolute,        4, 0},
-    Instruction{_DEF(STA), AddressMode::Absolute,        4, 0},
-    Instruction{_DEF(STX), AddressMode::Absolute,        4, 0},
-    Instruction{_DEF(SAX), AddressMode::Absolute,        4, 0},
+    Instruction{_DEF(STY), AddressMode::Absolute,        4, 0, 1},
+    Instruction{_DEF(STA), AddressMode::Absolute,        4, 0, 1},
+    Instruction{_DEF(STX), AddressMode::Absolute,        4, 0, 1},
+    Instruction{_DEF(SAX), AddressMode::Absolute,        4, 0, 1},
     Instruction{_DEF(BCC), AddressMode::Relative,        2, 1},
-    Instruction{_DEF(STA), AddressMode::IndirectIndexed, 6, 0},
+    Instruction{_DEF(STA), AddressMode::IndirectIndexed, 6, 0, 1},
     Instruction{_DEF(KIL), AddressMode::Implicit,        0, 0},
-    Instruction{_DEF(AHX), AddressMode::IndirectIndexed, 6, 0},
-    Instruction{_DEF(STY), AddressMode::ZeroPageX,       4, 0},
-    Instruction{_DEF(STA), AddressMode::ZeroPageX,       4, 0},
-    Instruction{_DEF(STX), AddressMode::ZeroPageY,       4, 0},
-    Instruction{_DEF(SAX), AddressMode::ZeroPageY,       4, 0},
+    Instruction{_DEF(AHX), AddressMode::IndirectIndexed, 6, 0, 1},
+    Instruction{_DEF(STY), AddressMode::ZeroPageX,       4, 0, 1},
+    Instruction{_DEF(STA), AddressMode::ZeroPageX,       4, 0, 1},
+    Instruction{_DEF(STX), AddressMode::ZeroPageY,       4, 0, 1},
+    Instruction{_DEF(SAX), AddressMode::ZeroPageY,       4, 0, 1},
     Instruction{_DEF(TYA), AddressMode::Implicit,        2, 0},
-    Instruction{_DEF(STA), AddressMode::AbsoluteY,       5, 0},
+    Instruction{_DEF(STA), AddressMode::AbsoluteY,       5, 0, 1},
     Instruction{_DEF(TXS), AddressMode::Implicit,        2, 0},
-    Instruction{_DEF(TAS), AddressMode::AbsoluteY,       5, 0},
-    Instruction{_DEF(SHY), AddressMode::AbsoluteX,       5, 0},
-    Instruction{_DEF(STA), AddressMode::AbsoluteX,       5, 0},
-    Instruction{_DEF(SHX), AddressMode::AbsoluteY,       5, 0},
-    Instruction{_DEF(AHX), AddressMode::AbsoluteY,       5, 0},
+    Instruction{_DEF(TAS), AddressMode::AbsoluteY,       5, 0, 1},
+    Instruction{_DEF(SHY), AddressMode::AbsoluteX,       5, 0, 1},
+    Instruction{_DEF(STA), AddressMode::AbsoluteX,       5, 0, 1},
+    Instruction{_DEF(SHX), AddressMode::AbsoluteY,       5, 0, 1},
+    Instruction{_DEF(AHX), AddressMode::AbsoluteY,       5, 0, 1},
     Instruction{_DEF(LDY), AddressMode::Immediate,       2, 0},
     Instruction{_DEF(LDA), AddressMode::IndexedIndirect, 6, 0},
     Instruction{_DEF(LDX), AddressMode::Immediate,       2, 0},
@@ -742,7 +742,7 @@ const InstructionSet instruction_set{
 };
 
 mu::Vec<Assembly>
-bytecodes_disassemble(const mu::Vec<uint8_t>& bytecodes, mu::memory::Allocator* allocator) {
+bytecodes_disassemble(std::span<const uint8_t> bytecodes, mu::memory::Allocator* allocator) {
     mu::Vec<Assembly> out(allocator);
 
     uint8_t const* mem = bytecodes.data();
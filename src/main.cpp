@@ -2,6 +2,10 @@
 #include <imgui-SFML.h>
 #include <SFML/Window.hpp>
 #include <SFML/Graphics.hpp>
+#include <SFML/Audio.hpp>
+
+#include <mutex>
+#include <thread>
 
 #include "Console.h"
 
@@ -36,6 +40,82 @@ namespace MyImGui {
         const char* format = (flags & ImGuiInputTextFlags_CharsHexadecimal) ? "0x%02X" : "%d";
         return ImGui::InputScalar(label, ImGuiDataType_U8, (void*)v, (void*)(step > 0 ? &step : NULL), (void*)(step_fast > 0 ? &step_fast : NULL), format, flags);
     }
+
+    // rows of a hex view as text, kept across frames so only the rows whose bytes changed get formatted again
+    struct HexViewCache {
+        static constexpr int WIDTH = 16; // bytes per row
+        static constexpr int ADDR_CHARS = 6;
+        static constexpr int ROW_CHARS = ADDR_CHARS + 2 * WIDTH;
+
+        mu::Vec<uint8_t> bytes; // what each row was formatted from
+        mu::Vec<char> text;
+        mu::Vec<bool> formatted;
+    };
+
+    void HexView(const char* id, HexViewCache& cache, const uint8_t* data, size_t size) {
+        constexpr int W = HexViewCache::WIDTH, A = HexViewCache::ADDR_CHARS;
+        static constexpr char NIBBLES[] = "0123456789ABCDEF";
+        constexpr auto TABLE_FLAGS = ImGuiTableFlags_ScrollX | ImGuiTableFlags_ScrollY | ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersOuter;
+        static constexpr auto HEADERS = [] {
+            mu::Arr<mu::Arr<char, 3>, W> headers {};
+            for (int i = 0; i < W; i++) {
+                headers[i] = mu::Arr<char, 3> {NIBBLES[i >> 4], NIBBLES[i & 0xF], 0};
+            }
+            return headers;
+        }();
+
+        const size_t rows = (size + W - 1) / W;
+        if (cache.formatted.size() != rows) {
+            cache.bytes = mu::Vec<uint8_t>(rows * W, 0);
+            cache.text = mu::Vec<char>(rows * HexViewCache::ROW_CHARS, ' ');
+            cache.formatted = mu::Vec<bool>(rows, false);
+        }
+        const int addr_chars = size > 0x10000 ? 6 : 4;
+
+        if (ImGui::BeginTable(id, W+1, TABLE_FLAGS)) {
+            ImGui::TableSetupScrollFreeze(1, 1);
+            ImGui::TableSetupColumn("", ImGuiTableColumnFlags_NoHeaderLabel);
+            for (const auto& header: HEADERS) {
+                ImGui::TableSetupColumn(header.data());
+            }
+            ImGui::TableHeadersRow();
+
+            ImGuiListClipper clipper((int) rows);
+            while (clipper.Step()) {
+                for (int j = clipper.DisplayStart; j < clipper.DisplayEnd; j++) {
+                    const size_t addr = size_t(j) * W;
+                    const int n = int(std::min<size_t>(W, size - addr));
+                    char* text = &cache.text[j * HexViewCache::ROW_CHARS];
+
+                    if (!cache.formatted[j] || memcmp(&cache.bytes[addr], data + addr, n) != 0) {
+                        memcpy(&cache.bytes[addr], data + addr, n);
+                        for (int k = 0; k < addr_chars; k++) {
+                            text[k] = NIBBLES[(addr >> (4 * (addr_chars - 1 - k))) & 0xF];
+                        }
+                        for (int i = 0; i < n; i++) {
+                            text[A + 2*i] = NIBBLES[data[addr + i] >> 4];
+                            text[A + 2*i + 1] = NIBBLES[data[addr + i] & 0xF];
+                        }
+                        cache.formatted[j] = true;
+                    }
+
+                    ImGui::TableNextRow();
+                    ImGui::TableSetColumnIndex(0);
+                    ImGui::TextUnformatted(text, text + addr_chars);
+
+                    ImGui::PushStyleColor(ImGuiCol_Text, ImVec4 {1.0f, 1.0f, 0, 1.0f});
+                    for (int i = 0; i < n; i++) {
+                        ImGui::TableSetColumnIndex(i+1);
+                        ImGui::TextUnformatted(text + A + 2*i, text + A + 2*i + 2);
+                    }
+                    ImGui::PopStyleColor();
+                }
+            }
+            clipper.End();
+
+            ImGui::EndTable();
+        }
+    }
 }
 
 namespace Config {
@@ -55,6 +135,16 @@ namespace Config {
         start = sf::Keyboard::Return,
         select = sf::Keyboard::Tab,
 
+        // held to fast-forward
+        fast_forward = sf::Keyboard::Space,
+
+        // held to go back in time
+        rewind = sf::Keyboard::Backspace,
+
+        // one savestate slot, kept next to the rom
+        save_state = sf::Keyboard::F2,
+        load_state = sf::Keyboard::F4,
+
         // debugging
         next_instr = sf::Keyboard::F10,
         debug = sf::Keyboard::D,
@@ -64,21 +154,102 @@ namespace Config {
         scroll_mem_up = sf::Keyboard::K;
 }
 
+// audio output, how full its queue is paces the emulation
+struct AudioStream: sf::SoundStream {
+    static constexpr unsigned SAMPLE_RATE = 48000;
+    static constexpr size_t CAPACITY = SAMPLE_RATE / 10; // 100 ms
+    static constexpr size_t CHUNK_SAMPLES = 512; // handed to sfml at once
+
+    std::mutex mutex;
+    mu::Arr<int16_t, CAPACITY> ring;
+    size_t read = 0, queued = 0;
+    mu::Arr<int16_t, CHUNK_SAMPLES> chunk; // sfml plays from it until the next onGetData
+
+    ~AudioStream() override {
+        stop();
+    }
+
+    void start() {
+        initialize(1, SAMPLE_RATE);
+        play();
+    }
+
+    bool onGetData(Chunk& data) override {
+        std::lock_guard lock(mutex);
+        for (auto& sample: chunk) {
+            if (queued == 0) {
+                sample = 0; // underrun, keep the stream going with silence
+                continue;
+            }
+            sample = ring[read];
+            read = (read + 1) % CAPACITY;
+            queued--;
+        }
+        data.samples = chunk.data();
+        data.sampleCount = chunk.size();
+        return true;
+    }
+
+    void onSeek(sf::Time) override {}
+};
+
+size_t audio_queued(AudioStream& self) {
+    std::lock_guard lock(self.mutex);
+    return self.queued;
+}
+
+void audio_push(AudioStream& self, const int16_t* samples, size_t count) {
+    std::lock_guard lock(self.mutex);
+    count = std::min(count, AudioStream::CAPACITY - self.queued);
+    for (size_t i = 0; i < count; i++) {
+        self.ring[(self.read + self.queued++) % AudioStream::CAPACITY] = samples[i];
+    }
+}
+
+// pattern tables drawn with the selected palette, kept across frames
+struct PatternTablesView {
+    sf::Texture textures[2];
+    uint8_t chr[2][256][16]; // tile bytes the textures were drawn from
+    Palette palette; // and the palette
+    bool valid;
+};
+
 struct World {
     mu::Str rom_path;
+    RomDb romdb;
     sf::RenderWindow window;
     mu::Str imgui_ini_file_path;
-    mu::Vec<sf::Texture> textures;
-    mu::Vec<sf::Sprite> sprites;
+    PatternTablesView pattern_tables;
+    MyImGui::HexViewCache ram_view, prg_view, chr_view;
 
     bool should_pause;
     bool do_one_instr;
 
+    bool fast_forward; // also while Config::fast_forward is held
+    int fast_forward_factor; // emulated frames per shown frame, 0 for as many as fit in one
+
+    int run_ahead; // frames shown ahead of the emulation, to hide the game's own input lag
+    mu::Vec<uint8_t> run_ahead_state;
+
+    Rewind rewind; // every emulated frame, while Config::rewind is held they are popped one per shown frame
+    bool rewinding;
+    bool rewind_threaded; // render worker was on before rewinding
+
     mu::Timer loop_timer;
     double frame_time_secs;
 
+    mu::Timer sav_timer; // since battery ram was last flushed
+
     Console console;
-    mu::Timer console_render_timer;
+    bool tv_system_forced; // instead of the ROM's region
+    TVSystem tv_system;
+
+    AudioStream audio;
+    double audio_samples_due; // fraction of a sample carried over to the next frame
+
+    // created once and only re-uploaded when the frame changes
+    sf::Texture screen_texture;
+    uint64_t screen_hash;
 };
 
 namespace sys {
@@ -90,6 +261,9 @@ namespace sys {
             sf::Style::Titlebar|sf::Style::Close
         );
         world.window.setPosition(sf::Vector2i(0,0));
+
+        // the audio queue decides when to emulate, so the loop only has to wait for vsync
+        world.window.setVerticalSyncEnabled(true);
     }
 
     void imgui_init(World& world) {
@@ -118,108 +292,73 @@ namespace sys {
     void imgui_memory_window(World& world) {
         if (ImGui::Begin("Memory")) {
             if (ImGui::BeginTabBar("memory_tab_bar")) {
-                constexpr uint32_t width = 16;
-                constexpr auto TABLE_FLAGS = ImGuiTableFlags_ScrollX | ImGuiTableFlags_ScrollY | ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersOuter;
-
                 if (ImGui::BeginTabItem("RAM")) {
-                    const auto height = int(world.console.ram.size() / width);
-                    if (ImGui::BeginTable("ram_table", width+1, TABLE_FLAGS)) {
-                        ImGui::TableSetupScrollFreeze(1, 1);
-                        ImGui::TableSetupColumn("", ImGuiTableColumnFlags_NoHeaderLabel);
-                        for (int i = 0; i < width; i++) {
-                            ImGui::TableSetupColumn(mu::str_tmpf("{:02X}", i).c_str());
-                        }
-                        ImGui::TableHeadersRow();
-
-                        ImGuiListClipper clipper(height);
-                        while (clipper.Step()) {
-                            for (int j = clipper.DisplayStart; j < clipper.DisplayEnd; j++) {
-                                ImGui::TableNextRow();
-                                ImGui::TableSetColumnIndex(0);
-                                ImGui::Text(mu::str_tmpf("{:04X}", j).c_str());
-
-                                for (int i = 0; i < width; i++) {
-                                    ImGui::TableSetColumnIndex(i+1);
-                                    ImGui::TextColored(ImVec4 {1.0f, 1.0f, 0, 1.0f}, mu::str_tmpf("{:02X}", world.console.ram[j*width+i]).c_str());
-                                }
-                            }
-                        }
-                        clipper.End();
-
-                        ImGui::EndTable();
-                    }
-
+                    const auto& ram = world.console.ram;
+                    MyImGui::HexView("ram_table", world.ram_view, ram.data(), ram.size());
                     ImGui::EndTabItem();
                 }
 
                 if (ImGui::BeginTabItem("PRG")) {
                     const auto& prg = world.console.rom.prg;
-                    const auto height = int(prg.size() / width);
-                    if (ImGui::BeginTable("ram_table", width+1, TABLE_FLAGS)) {
-                        ImGui::TableSetupScrollFreeze(1, 1);
-                        ImGui::TableSetupColumn("", ImGuiTableColumnFlags_NoHeaderLabel);
-                        for (int i = 0; i < width; i++) {
-                            ImGui::TableSetupColumn(mu::str_tmpf("{:02X}", i).c_str());
-                        }
-                        ImGui::TableHeadersRow();
-
-                        ImGuiListClipper clipper(height);
-                        while (clipper.Step()) {
-                            for (int j = clipper.DisplayStart; j < clipper.DisplayEnd; j++) {
-                                ImGui::TableNextRow();
-                                ImGui::TableSetColumnIndex(0);
-                                ImGui::Text(mu::str_tmpf("{:04X}", j).c_str());
-
-                                for (int i = 0; i < width; i++) {
-                                    ImGui::TableSetColumnIndex(i+1);
-                                    ImGui::TextColored(ImVec4 {1.0f, 1.0f, 0, 1.0f}, mu::str_tmpf("{:02X}", prg[j*width+i]).c_str());
-                                }
-                            }
-                        }
-                        clipper.End();
-
-                        ImGui::EndTable();
-                    }
-
+                    MyImGui::HexView("prg_table", world.prg_view, prg.data(), prg.size());
                     ImGui::EndTabItem();
                 }
 
                 if (ImGui::BeginTabItem("CHR")) {
                     const auto& chr = world.console.rom.chr;
-                    const auto height = int(chr.size() / width);
-                    if (ImGui::BeginTable("ram_table", width+1, TABLE_FLAGS)) {
-                        ImGui::TableSetupScrollFreeze(1, 1);
-                        ImGui::TableSetupColumn("", ImGuiTableColumnFlags_NoHeaderLabel);
-                        for (int i = 0; i < width; i++) {
-                            ImGui::TableSetupColumn(mu::str_tmpf("{:02X}", i).c_str());
-                        }
-                        ImGui::TableHeadersRow();
+                    MyImGui::HexView("chr_table", world.chr_view, chr.data(), chr.size());
+                    ImGui::EndTabItem();
+                }
 
-                        ImGuiListClipper clipper(height);
-                        while (clipper.Step()) {
-                            for (int j = clipper.DisplayStart; j < clipper.DisplayEnd; j++) {
-                                ImGui::TableNextRow();
-                                ImGui::TableSetColumnIndex(0);
-                                ImGui::Text(mu::str_tmpf("{:04X}", j).c_str());
+                ImGui::EndTabBar();
+            }
+        }
+        ImGui::End();
+    }
 
-                                for (int i = 0; i < width; i++) {
-                                    ImGui::TableSetColumnIndex(i+1);
-                                    ImGui::TextColored(ImVec4 {1.0f, 1.0f, 0, 1.0f}, mu::str_tmpf("{:02X}", chr[j*width+i]).c_str());
-                                }
-                            }
-                        }
-                        clipper.End();
+    void pattern_tables_update(World& world, PaletteType palette_type, int palette_index) {
+        auto& view = world.pattern_tables;
+        const auto& ppu = world.console.ppu;
+        const Palette& palette = palette_type == PaletteType::BG ?
+            ppu.bg_palettes[palette_index] : ppu.sprite_palettes[palette_index];
 
-                        ImGui::EndTable();
-                    }
+        if (!view.valid) {
+            for (auto& texture: view.textures) {
+                if (texture.create(8*16, 8*16) == false) {
+                    mu::panic("failed to create texture");
+                }
+            }
+        }
 
-                    ImGui::EndTabItem();
+        // a palette change recolors every tile, otherwise only tiles whose bytes changed are uploaded
+        const bool redraw_all = !view.valid || memcmp(&view.palette, &palette, sizeof(Palette)) != 0;
+        view.palette = palette;
+        view.valid = true;
+
+        RGBAColor colors[4];
+        for (int i = 0; i < 4; i++) {
+            colors[i] = color_from_palette(palette.index[i]);
+        }
+
+        RGBAColor pixels[8*8];
+        for (int table = 0; table < 2; table++) {
+            for (int tile = 0; tile < 256; tile++) {
+                const uint16_t addr = table * region_size(PATT_TBL0) + tile * 16;
+                const uint8_t* bytes = &ppu.chr_banks[addr >> 10][addr & 0x3FF];
+                if (!redraw_all && memcmp(view.chr[table][tile], bytes, 16) == 0) {
+                    continue;
                 }
+                memcpy(view.chr[table][tile], bytes, 16);
 
-                ImGui::EndTabBar();
+                for (int j = 0; j < 8; j++) {
+                    const uint8_t l = bytes[j], h = bytes[j + 8];
+                    for (int i = 0; i < 8; i++) {
+                        pixels[j*8+i] = colors[((h >> (7-i)) & 1) << 1 | ((l >> (7-i)) & 1)];
+                    }
+                }
+                view.textures[table].update((const sf::Uint8*)pixels, 8, 8, tile % 16 * 8, tile / 16 * 8);
             }
         }
-        ImGui::End();
     }
 
     void imgui_viewer_window(World& world) {
@@ -236,12 +375,13 @@ namespace sys {
                     ImGui::SliderInt("Palette Index", &palette_index, 0, 3, "%d", ImGuiSliderFlags_AlwaysClamp);
                     ImGui::NewLine();
 
+                    pattern_tables_update(world, palette_type, palette_index);
+
                     if (ImGui::CollapsingHeader("Tiles")) {
                         static auto table_half = PatternTablePointer::TableHalf::LEFT;
                         static int row = 0, col = 0;
 
                         auto tile_indices = console_get_tile_as_indices(world.console, table_half, row, col, mu::memory::tmp());
-                        auto tile_pixels = console_get_tile_as_pixels(world.console, tile_indices, palette_type, palette_index, mu::memory::tmp());
 
                         // tile as indices
                         constexpr auto TABLE_FLAGS = ImGuiTableFlags_NoHostExtendX | ImGuiTableFlags_SizingFixedFit | ImGuiTableFlags_BordersOuter;
@@ -273,14 +413,8 @@ namespace sys {
 
                         ImGui::SameLine();
 
-                        // tile as image
-                        auto& tile_texture = world.textures.emplace_back(sf::Texture());
-                        if (tile_texture.create(8, 8) == false) {
-                            mu::panic("failed to create texture");
-                        }
-                        auto& tile_sprite = world.sprites.emplace_back(sf::Sprite(tile_texture));
-                        tile_sprite.setTexture(tile_texture);
-                        tile_texture.update((const sf::Uint8*)tile_pixels.data());
+                        // tile as image, cut out of its table
+                        sf::Sprite tile_sprite(world.pattern_tables.textures[(int)table_half], sf::IntRect(col*8, row*8, 8, 8));
                         tile_sprite.setScale(15 * Config::view_scale, 15 * Config::view_scale);
                         ImGui::Image(tile_sprite);
 
@@ -294,25 +428,11 @@ namespace sys {
                     }
 
                     if (ImGui::CollapsingHeader("Tables", ImGuiTreeNodeFlags_DefaultOpen)) {
-                        mu::memory::Arena arena {};
                         mu::StrView table_name[2] {"Left", "Right"};
                         for (int table = 0; table < 2; table++)  {
                             ImGui::Text(mu::str_tmpf("{} Half", table_name[table]).c_str());
 
-                            auto& texture = world.textures.emplace_back(sf::Texture());
-                            if (texture.create(8*16, 8*16) == false) {
-                                mu::panic("failed to create texture");
-                            }
-
-                            for (int row = 0; row < 16; row++) {
-                                for (int col = 0; col < 16; col++) {
-                                    auto tile_indices = console_get_tile_as_indices(world.console, (PatternTablePointer::TableHalf)table, row, col, &arena);
-                                    auto tile_pixels = console_get_tile_as_pixels(world.console, tile_indices, palette_type, palette_index, &arena);
-                                    texture.update((const sf::Uint8*)tile_pixels.data(), 8, 8, col*8, row*8);
-                                }
-                            }
-
-                            auto& sprite = world.sprites.emplace_back(sf::Sprite(texture));
+                            sf::Sprite sprite(world.pattern_tables.textures[table]);
                             sprite.setScale(2 * Config::view_scale, 2 * Config::view_scale);
                             ImGui::Image(sprite);
                         }
@@ -342,6 +462,12 @@ namespace sys {
                             ImGuiColorEditFlags palette_button_flags = ImGuiColorEditFlags_NoAlpha | ImGuiColorEditFlags_NoPicker;
                             if (ImGui::ColorButton(mu::str_tmpf("0x{:02X}##palette", i).c_str(), colorvec, palette_button_flags, ImVec2(20, 20))) {
                                 *popup_clr_index_ptr = i;
+
+                                // the edit bypasses the ppu registers, so the render worker has to start over from it
+                                if (world.console.render_worker) {
+                                    console_set_render_worker(world.console, false);
+                                    console_set_render_worker(world.console, true);
+                                }
                                 ImGui::CloseCurrentPopup();
                             }
 
@@ -420,6 +546,21 @@ namespace sys {
             world.do_one_instr = ImGui::Button("Step");
             ImGui::EndDisabled();
 
+            ImGui::Checkbox("Fast Forward", &world.fast_forward);
+            ImGui::SameLine();
+            ImGui::SliderInt("x", &world.fast_forward_factor, 0, 16, world.fast_forward_factor == 0 ? "Uncapped" : "%d", ImGuiSliderFlags_AlwaysClamp);
+            ImGui::SliderInt("Run Ahead", &world.run_ahead, 0, 3, "%d frames", ImGuiSliderFlags_AlwaysClamp);
+
+            auto tv_system = world.console.ppu.tv_system;
+            MyImGui::EnumsCombo("Region", &tv_system, {
+                {TVSystem::NTSC, "NTSC"},
+                {TVSystem::PAL, "PAL"},
+                {TVSystem::DENDY, "Dendy"},
+            });
+            if (tv_system != world.console.ppu.tv_system) {
+                console_set_tv_system(world.console, tv_system);
+            }
+
             ImGui::SameLine();
 
             if (ImGui::Button("Reset")) {
@@ -486,8 +627,6 @@ namespace sys {
     }
 
     void wnd_rendering_begin(World& world) {
-        world.textures = mu::Vec<sf::Texture>(mu::memory::tmp());
-        world.sprites = mu::Vec<sf::Sprite>(mu::memory::tmp());
         world.window.setView(world.window.getDefaultView());
         world.window.clear();
     }
@@ -496,6 +635,45 @@ namespace sys {
         world.window.display();
     }
 
+    void state_save(World& world) {
+        mu::Vec<uint8_t> state;
+        console_save_state(world.console, state);
+
+        const auto path = mu::str_format("{}.state", world.rom_path);
+        auto file = fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            mu::log_error("failed to open '{}' for writing", path);
+            return;
+        }
+        mu_defer(fclose(file));
+
+        if (fwrite(state.data(), 1, state.size(), file) != state.size()) {
+            mu::log_error("failed to write savestate to '{}'", path);
+            return;
+        }
+        mu::log_info("saved state to '{}'", path);
+    }
+
+    void state_load(World& world) {
+        const auto path = mu::str_format("{}.state", world.rom_path);
+        auto file = fopen(path.c_str(), "rb");
+        if (file == nullptr) {
+            mu::log_error("no savestate at '{}'", path);
+            return;
+        }
+        mu_defer(fclose(file));
+
+        mu::Vec<uint8_t> state;
+        uint8_t chunk[4096];
+        for (size_t n; (n = fread(chunk, 1, sizeof(chunk), file)) > 0;) {
+            state.insert(state.end(), chunk, chunk + n);
+        }
+
+        if (console_load_state(world.console, state.data(), state.size())) {
+            mu::log_info("loaded state from '{}'", path);
+        }
+    }
+
     void events_collect(World& world) {
         sf::Event event;
         while (world.window.pollEvent(event)) {
@@ -510,6 +688,12 @@ namespace sys {
                 case Config::exit:
                     world.window.close();
                     break;
+                case Config::save_state:
+                    state_save(world);
+                    break;
+                case Config::load_state:
+                    state_load(world);
+                    break;
                 }
                 break;
             }
@@ -522,10 +706,72 @@ namespace sys {
     }
 
     void console_init(World& world) {
-        console_init(world.console, world.rom_path);
+        // headers of known bad dumps get corrected, if the database is there
+        romdb_open(world.romdb, ASSETS_DIR "/romdb.bin");
+        if (auto error = console_init(world.console, world.rom_path, &world.romdb, rom_sav_path(world.rom_path)); error != RomError::NONE) {
+            mu::panic("failed to load '{}': {}", world.rom_path, rom_error_str(error));
+        }
+        if (world.tv_system_forced) {
+            console_set_tv_system(world.console, world.tv_system);
+        }
+
+        // rasterize on another core while the emulation runs the next frame
+        console_set_render_worker(world.console, std::thread::hardware_concurrency() > 1);
+
+        // 60 seconds of frames, most of a game's state stays the same between frames so they fit in a few MB
+        world.rewind = rewind_new(4 * 1024 * 1024, 60 * 60);
 
         world.should_pause = true;
         world.do_one_instr = false;
+        world.fast_forward_factor = 4;
+    }
+
+    // nesemu --scan <dir>, indexes every .nes under dir into dir/.nesemu-index
+    int library_scan(const char* dir) {
+        const auto index_path = mu::str_format("{}/{}", dir, ROM_INDEX_FILE);
+        const auto timer = mu::timer_new();
+
+        RomIndex index {};
+        rom_index_load(index, index_path.c_str());
+
+        RomDb db {};
+        romdb_open(db, ASSETS_DIR "/romdb.bin");
+        mu_defer(romdb_close(db));
+
+        const auto hashed = rom_index_scan(index, dir, &db, std::max(1u, std::thread::hardware_concurrency()));
+        if (!rom_index_save(index, index_path.c_str())) {
+            return 1;
+        }
+
+        fmt::print("indexed {} roms into {}, {} new or changed, in {} ms\n", index.entries.size(), index_path, hashed, mu::timer_elapsed(timer));
+        return 0;
+    }
+
+    void console_free(World& world) {
+        console_set_render_worker(world.console, false);
+        rom_free(world.console.rom);
+        romdb_close(world.romdb);
+    }
+
+    void audio_init(World& world) {
+        world.audio.start();
+    }
+
+    // one frame worth of samples, nudged by up to half a percent to keep the queue centered,
+    // so small differences between the emulated and the host clocks never pile up
+    void audio_push_frame(World& world) {
+        constexpr double MAX_RATE_DELTA = 0.005;
+        const double fill = double(audio_queued(world.audio)) / AudioStream::CAPACITY;
+        const double ratio = 1.0 + (1.0 - 2.0 * fill) * MAX_RATE_DELTA;
+
+        const double fps = video_system_fps(video_system(world.console.ppu.tv_system));
+        world.audio_samples_due += AudioStream::SAMPLE_RATE / fps * ratio;
+        const auto count = size_t(world.audio_samples_due);
+        world.audio_samples_due -= count;
+
+        // no APU yet, the console is silent
+        static const mu::Arr<int16_t, AudioStream::CAPACITY> silence {};
+        audio_push(world.audio, silence.data(), count);
     }
 
     void console_update(World& world) {
@@ -541,34 +787,112 @@ namespace sys {
             //     .right   = sf::Keyboard::isKeyPressed(Config::right)
             // });
 
-            console_clock(world.console);
+            const bool rewind = !world.should_pause && sf::Keyboard::isKeyPressed(Config::rewind);
+            if (rewind != world.rewinding) {
+                // every load would restart the render worker, rasterize here while rewinding
+                if (rewind) {
+                    world.rewind_threaded = world.console.render_worker != nullptr;
+                    console_set_render_worker(world.console, false);
+                } else {
+                    console_set_render_worker(world.console, world.rewind_threaded);
+                }
+                world.rewinding = rewind;
+            }
 
-            if (mu::timer_elapsed(world.console_render_timer) >= Config::sys.millis_per_frame) {
-                world.console_render_timer = mu::timer_new();
-                ppu_render(world.console.ppu, world.console.screen_buf);
+            if (world.should_pause) {
+                console_clock(world.console);
+                console_render(world.console);
+            } else if (world.rewinding) {
+                // back one frame per emulated frame, paced by the audio queue the same as going forward
+                constexpr int MAX_FRAMES_PER_UPDATE = 4;
+                for (int i = 0; i < MAX_FRAMES_PER_UPDATE && audio_queued(world.audio) < AudioStream::CAPACITY / 2; i++) {
+                    if (!rewind_pop(world.rewind, world.console)) {
+                        break;
+                    }
+                    audio_push_frame(world);
+                }
+                console_render(world.console);
+            } else {
+                const bool fast_forward = world.fast_forward || sf::Keyboard::isKeyPressed(Config::fast_forward);
+                const bool uncapped = fast_forward && world.fast_forward_factor == 0;
+
+                if (uncapped) {
+                    // as many frames as fit in one host frame, audio can't keep up anyway
+                    const double millis_per_frame = 1000.0 / video_system_fps(video_system(world.console.ppu.tv_system));
+                    const auto budget = mu::timer_new();
+                    while (mu::timer_elapsed(budget) < millis_per_frame) {
+                        console_run_frame(world.console, false);
+                        rewind_push(world.rewind, world.console);
+                    }
+                    console_run_ahead(world.console, world.run_ahead_state, world.run_ahead);
+                    rewind_push(world.rewind, world.console);
+                } else {
+                    // the audio device drains the queue by its own clock, emulate until it's half full again,
+                    // but only a few frames per update so a stall doesn't turn into a burst
+                    constexpr int MAX_FRAMES_PER_UPDATE = 4;
+                    for (int i = 0; i < MAX_FRAMES_PER_UPDATE && audio_queued(world.audio) < AudioStream::CAPACITY / 2; i++) {
+                        // frames in between are emulated, but never rasterized nor uploaded
+                        if (fast_forward) {
+                            for (int j = 1; j < world.fast_forward_factor; j++) {
+                                console_run_frame(world.console, false);
+                                rewind_push(world.rewind, world.console);
+                            }
+                        }
+
+                        console_run_ahead(world.console, world.run_ahead_state, world.run_ahead);
+                        rewind_push(world.rewind, world.console);
+                        audio_push_frame(world);
+                    }
+                }
             }
         }
         world.do_one_instr = !world.should_pause;
+
+        // battery ram writes are already in the page cache, this only has the os write them out
+        // sooner, and it never waits for the disk
+        constexpr uint64_t SAV_FLUSH_MILLIS = 5000;
+        if (mu::timer_elapsed(world.sav_timer) >= SAV_FLUSH_MILLIS) {
+            rom_flush_sav(world.console.rom);
+            world.sav_timer = mu::timer_new();
+        }
     }
 
     void console_render_screen(World& world) {
-        sf::Texture tex;
-        if (tex.create(Config::resolution.w, Config::resolution.h) == false) {
-            mu::panic("failed to create texture");
+        const auto& screen_buf = world.console.screen_buf;
+
+        if (world.screen_texture.getSize() != sf::Vector2u(screen_buf.w, screen_buf.h)) {
+            if (world.screen_texture.create(screen_buf.w, screen_buf.h) == false) {
+                mu::panic("failed to create texture");
+            }
+            world.screen_hash = ~screenbuf_hash(screen_buf);
+        }
+
+        // paused, or the game didn't draw anything new, no need to upload again
+        const uint64_t hash = screenbuf_hash(screen_buf);
+        if (hash != world.screen_hash) {
+            world.screen_texture.update((const sf::Uint8*) screen_buf.pixels.data());
+            world.screen_hash = hash;
         }
-        tex.update((const sf::Uint8*) world.console.screen_buf.pixels.data());
 
-        world.window.setView(sf::View(sf::FloatRect(0, 0, (float)world.console.screen_buf.w, (float)world.console.screen_buf.h)));
-        world.window.draw(sf::Sprite(tex));
+        world.window.setView(sf::View(sf::FloatRect(0, 0, (float)screen_buf.w, (float)screen_buf.h)));
+        world.window.draw(sf::Sprite(world.screen_texture));
     }
 }
 
 int main(int argc, char** argv) {
     if (argc > 1 && argv[1] == mu::StrView("--help")) {
-        fmt::print(stderr, "Usage: {} </path/to/rom | --test [args to Catch2] | --help>\n", mu::file_get_base_name(argv[0]));
+        fmt::print(stderr, "Usage: {} </path/to/rom [--ntsc | --pal | --dendy] | --test [args to Catch2] | --scan <dir> | --make-romdb <in.csv> <out.bin> | --help>\n", mu::file_get_base_name(argv[0]));
         return 1;
     }
 
+    if (argc > 3 && argv[1] == mu::StrView("--make-romdb")) {
+        return romdb_from_csv(argv[2], argv[3]) ? 0 : 1;
+    }
+
+    if (argc > 2 && argv[1] == mu::StrView("--scan")) {
+        return sys::library_scan(argv[2]);
+    }
+
     if (argc > 1 && argv[1] == mu::StrView("--test")) {
         return run_tests(argc-1, argv+1);
     }
@@ -577,12 +901,28 @@ int main(int argc, char** argv) {
         .rom_path = argc > 1 ? argv[1] : ASSETS_DIR "/nestest.nes",
     };
 
+    // region override, for ROMs with a missing or wrong header
+    if (argc > 2) {
+        constexpr std::pair<const char*, TVSystem> REGIONS[] = {
+            {"--ntsc", TVSystem::NTSC}, {"--pal", TVSystem::PAL}, {"--dendy", TVSystem::DENDY},
+        };
+        for (const auto& [flag, tv_system] : REGIONS) {
+            if (argv[2] == mu::StrView(flag)) {
+                world.tv_system_forced = true;
+                world.tv_system = tv_system;
+            }
+        }
+    }
+
     sys::window_init(world);
 
     sys::imgui_init(world);
     mu_defer(sys::imgui_free(world));
 
     sys::console_init(world);
+    mu_defer(sys::console_free(world));
+
+    sys::audio_init(world);
 
     sys::clock_update(world);
 
@@ -614,18 +954,8 @@ int main(int argc, char** argv) {
 /*
 TODO:
 - remove vram
-- nametable
-    - what are registers?
-    - render one frame without color
-    - render one frame with color from one palette
-    - select palette from attribute table
-- sprites
-    - render one sprite without color
-    - select color from palette
 - complete all nestest.nes
 - support illegal NES instructions
 - handle reset correctly (how?)
-- handle NMI correctly (how?)
 - handle IRQ correctly (how?)
-- perform one PPU cycle
 */
@@ -0,0 +1,245 @@
+#include <catch2/catch.hpp>
+
+#include "Console.h"
+
+// every 8 KB prg bank and 1 KB chr bank starts with its own number
+static void load_banked_rom(Console& dev, uint8_t mapper, size_t prg_16k, size_t chr_8k) {
+    dev.rom.header.flags6.bits.lower_mapper_num = mapper;
+
+    rom_set_prg(dev.rom, mu::Vec<uint8_t>(prg_16k * 16*1024, 0));
+    for (size_t bank = 0; bank < prg_16k * 2; bank++) {
+        dev.rom.prg[bank * 8*1024] = bank;
+    }
+
+    rom_set_chr(dev.rom, mu::Vec<uint8_t>(chr_8k * 8*1024, 0));
+    for (size_t bank = 0; bank < chr_8k * 8; bank++) {
+        dev.rom.chr[bank * 1024] = bank;
+    }
+
+    rom_alloc_prg_ram(dev.rom);
+    console_reset(dev);
+}
+
+static uint8_t prg_bank_at(Console& dev, uint16_t addr) {
+    return cpu_read(dev.cpu, addr);
+}
+
+static uint8_t chr_bank_at(Console& dev, uint16_t addr) {
+    return dev.ppu.chr_banks[addr >> 10][0];
+}
+
+static void mmc1_write(Console& dev, uint16_t addr, uint8_t value) {
+    for (int i = 0; i < 5; i++) {
+        cpu_write(dev.cpu, addr, (value >> i) & 1);
+    }
+}
+
+TEST_CASE("mappers") {
+    Console dev {};
+    console_init(dev);
+
+    SECTION("nrom-128-is-mirrored") {
+        load_banked_rom(dev, 0, 1, 1);
+        REQUIRE(prg_bank_at(dev, 0x8000) == 0);
+        REQUIRE(prg_bank_at(dev, 0xA000) == 1);
+        REQUIRE(prg_bank_at(dev, 0xC000) == 0);
+        REQUIRE(prg_bank_at(dev, 0xE000) == 1);
+
+        cpu_write(dev.cpu, 0x8000, 0x42); // rom, ignored
+        REQUIRE(prg_bank_at(dev, 0x8000) == 0);
+    }
+
+    SECTION("uxrom") {
+        load_banked_rom(dev, 2, 8, 1);
+        REQUIRE(prg_bank_at(dev, 0xC000) == 14);
+
+        cpu_write(dev.cpu, 0x8000, 3);
+        REQUIRE(prg_bank_at(dev, 0x8000) == 6);
+        REQUIRE(prg_bank_at(dev, 0xA000) == 7);
+        REQUIRE(prg_bank_at(dev, 0xC000) == 14);
+    }
+
+    SECTION("cnrom") {
+        load_banked_rom(dev, 3, 2, 4);
+        cpu_write(dev.cpu, 0x8000, 2);
+        REQUIRE(chr_bank_at(dev, 0x0000) == 16);
+        REQUIRE(chr_bank_at(dev, 0x1C00) == 23);
+    }
+
+    SECTION("axrom") {
+        load_banked_rom(dev, 7, 8, 1);
+        REQUIRE(dev.ppu.mirroring == Mirroring::SINGLE_LOWER);
+
+        cpu_write(dev.cpu, 0x8000, 0x12);
+        REQUIRE(prg_bank_at(dev, 0x8000) == 8);
+        REQUIRE(prg_bank_at(dev, 0xE000) == 11);
+        REQUIRE(dev.ppu.mirroring == Mirroring::SINGLE_UPPER);
+    }
+
+    SECTION("mmc1") {
+        load_banked_rom(dev, 1, 8, 4);
+        REQUIRE(prg_bank_at(dev, 0xC000) == 14);
+
+        mmc1_write(dev, 0xE000, 2);
+        REQUIRE(prg_bank_at(dev, 0x8000) == 4);
+        REQUIRE(prg_bank_at(dev, 0xC000) == 14);
+
+        // vertical mirroring, first bank fixed, 4 KB chr banks
+        mmc1_write(dev, 0x8000, 0b11010);
+        REQUIRE(dev.ppu.mirroring == Mirroring::VERTICAL);
+        REQUIRE(prg_bank_at(dev, 0x8000) == 0);
+        REQUIRE(prg_bank_at(dev, 0xC000) == 4);
+
+        mmc1_write(dev, 0xA000, 3);
+        mmc1_write(dev, 0xC000, 5);
+        REQUIRE(chr_bank_at(dev, 0x0000) == 12);
+        REQUIRE(chr_bank_at(dev, 0x1000) == 20);
+
+        // a write with bit 7 resets the shift register
+        cpu_write(dev.cpu, 0xE000, 1);
+        cpu_write(dev.cpu, 0xE000, 0x80);
+        mmc1_write(dev, 0xE000, 1);
+        REQUIRE(prg_bank_at(dev, 0x8000) == 2);
+
+        cpu_write(dev.cpu, 0x6000, 0x42);
+        REQUIRE(cpu_read(dev.cpu, 0x6000) == 0x42);
+    }
+
+    SECTION("mmc3") {
+        load_banked_rom(dev, 4, 8, 8);
+        REQUIRE(prg_bank_at(dev, 0xC000) == 14);
+        REQUIRE(prg_bank_at(dev, 0xE000) == 15);
+
+        cpu_write(dev.cpu, 0x8000, 6);
+        cpu_write(dev.cpu, 0x8001, 5);
+        cpu_write(dev.cpu, 0x8000, 7);
+        cpu_write(dev.cpu, 0x8001, 9);
+        REQUIRE(prg_bank_at(dev, 0x8000) == 5);
+        REQUIRE(prg_bank_at(dev, 0xA000) == 9);
+
+        // swapped prg mode, $8000 is fixed to the second last bank
+        cpu_write(dev.cpu, 0x8000, 0x40);
+        REQUIRE(prg_bank_at(dev, 0x8000) == 14);
+        REQUIRE(prg_bank_at(dev, 0xC000) == 5);
+
+        cpu_write(dev.cpu, 0x8000, 0);
+        cpu_write(dev.cpu, 0x8001, 21);
+        cpu_write(dev.cpu, 0x8000, 2);
+        cpu_write(dev.cpu, 0x8001, 33);
+        REQUIRE(chr_bank_at(dev, 0x0000) == 20);
+        REQUIRE(chr_bank_at(dev, 0x0400) == 21);
+        REQUIRE(chr_bank_at(dev, 0x1000) == 33);
+
+        // inverted chr, the 1 KB banks go to $0000
+        cpu_write(dev.cpu, 0x8000, 0x80);
+        REQUIRE(chr_bank_at(dev, 0x0000) == 33);
+        REQUIRE(chr_bank_at(dev, 0x1000) == 20);
+
+        cpu_write(dev.cpu, 0xA000, 1);
+        REQUIRE(dev.ppu.mirroring == Mirroring::HORIZONTAL);
+    }
+
+    SECTION("mmc3-scanline-irq") {
+        load_banked_rom(dev, 4, 8, 8);
+        dev.cpu.cycles = 0xFFFF; // keep the cpu from taking the irq
+
+        auto run_until = [&](auto done) {
+            for (int i = 0; i < 341 * 262 && !done(); i++) {
+                console_clock(dev);
+            }
+        };
+        run_until([&] { return dev.ppu.row == 241; });
+
+        // sprites at $1000, A12 rises at dot 260 of the pre-render and visible lines
+        cpu_write(dev.cpu, 0x2000, 0x08);
+        cpu_write(dev.cpu, 0x2001, 0x18);
+        cpu_write(dev.cpu, 0xC000, 10);
+        cpu_write(dev.cpu, 0xC001, 0);
+        cpu_write(dev.cpu, 0xE001, 0);
+
+        // reloaded on the pre-render line, then 10 lines down to zero
+        run_until([&] { return dev.cpu.irq_line; });
+        REQUIRE(dev.cpu.irq_line);
+        REQUIRE(dev.ppu.row == 9);
+        REQUIRE(dev.ppu.col == 261);
+
+        // acknowledged, reloads on the next line
+        cpu_write(dev.cpu, 0xE000, 0);
+        cpu_write(dev.cpu, 0xE001, 0);
+        REQUIRE_FALSE(dev.cpu.irq_line);
+        run_until([&] { return dev.cpu.irq_line; });
+        REQUIRE(dev.ppu.row == 20);
+        REQUIRE(dev.ppu.col == 261);
+
+        // background at $1000 moves the rise to the next line's tile fetches
+        cpu_write(dev.cpu, 0xE000, 0);
+        cpu_write(dev.cpu, 0x2000, 0x10);
+        cpu_write(dev.cpu, 0xC000, 4);
+        cpu_write(dev.cpu, 0xE001, 0);
+        run_until([&] { return dev.cpu.irq_line; });
+        REQUIRE(dev.ppu.row == 24);
+        REQUIRE(dev.ppu.col == 325);
+
+        // no rendering, no clocks
+        cpu_write(dev.cpu, 0xE000, 0);
+        cpu_write(dev.cpu, 0x2001, 0);
+        cpu_write(dev.cpu, 0xE001, 0);
+        REQUIRE(dev.mapper.irq_at == UINT64_MAX);
+        const auto counter = dev.mapper.irq_counter;
+        console_run_frame(dev);
+        cpu_write(dev.cpu, 0x2001, 0x18);
+        REQUIRE(dev.mapper.irq_counter == counter);
+        REQUIRE_FALSE(dev.cpu.irq_line);
+    }
+
+    SECTION("mmc3-irq-survives-region-switch") {
+        load_banked_rom(dev, 4, 8, 8);
+        dev.cpu.cycles = 0xFFFF; // keep the cpu from taking the irq
+
+        auto run_until = [&](auto done) {
+            for (int i = 0; i < 341 * 312 && !done(); i++) {
+                console_clock(dev);
+            }
+        };
+        for (int i = 0; i < 3; i++) {
+            console_run_frame(dev, false);
+        }
+        run_until([&] { return dev.ppu.row == 241; });
+
+        cpu_write(dev.cpu, 0x2000, 0x08);
+        cpu_write(dev.cpu, 0x2001, 0x18);
+        cpu_write(dev.cpu, 0xC000, 10);
+        cpu_write(dev.cpu, 0xC001, 0);
+        cpu_write(dev.cpu, 0xE001, 0);
+
+        // the frames before the switch were shorter, none of them is clocked again
+        console_set_tv_system(dev, TVSystem::PAL);
+        run_until([&] { return dev.cpu.irq_line; });
+        REQUIRE(dev.ppu.row == 9);
+        REQUIRE(dev.ppu.col == 261);
+
+        cpu_write(dev.cpu, 0xE000, 0);
+        cpu_write(dev.cpu, 0xE001, 0);
+        console_set_tv_system(dev, TVSystem::NTSC);
+        run_until([&] { return dev.cpu.irq_line; });
+        REQUIRE(dev.ppu.row == 20);
+        REQUIRE(dev.ppu.col == 261);
+    }
+
+    SECTION("savestate-keeps-the-banks") {
+        load_banked_rom(dev, 4, 8, 8);
+        cpu_write(dev.cpu, 0x8000, 6);
+        cpu_write(dev.cpu, 0x8001, 5);
+        cpu_write(dev.cpu, 0x6123, 0x42);
+
+        mu::Vec<uint8_t> state;
+        console_save_state(dev, state);
+
+        cpu_write(dev.cpu, 0x8001, 3);
+        cpu_write(dev.cpu, 0x6123, 0);
+        REQUIRE(console_load_state(dev, state.data(), state.size()));
+        REQUIRE(prg_bank_at(dev, 0x8000) == 5);
+        REQUIRE(cpu_read(dev.cpu, 0x6123) == 0x42);
+        REQUIRE(dev.mapper.banks[6] == 5);
+    }
+}
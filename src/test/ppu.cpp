@@ -0,0 +1,474 @@
+#include <catch2/catch.hpp>
+
+#include <thread>
+
+#include "Console.h"
+
+static void vram_write(Console& dev, uint16_t addr, uint8_t data) {
+    cpu_write(dev.cpu, VRAM_ADDR_REG1, addr >> 8);
+    cpu_write(dev.cpu, VRAM_ADDR_REG1, addr & 0xFF);
+    cpu_write(dev.cpu, VRAM_IO_REG, data);
+}
+
+static void use_chr_ram(Console& dev) {
+    rom_set_chr(dev.rom, mu::Vec<uint8_t>(8*1024, 0));
+    for (uint8_t i = 0; i < 8; i++) {
+        ppu_map_chr(dev.ppu, i, &dev.rom.chr[i * 1024]);
+    }
+    dev.ppu.chr_ram = true;
+}
+
+static void scroll(Console& dev, uint8_t x, uint8_t y) {
+    cpu_read(dev.cpu, PPU_STS_REG);
+    cpu_write(dev.cpu, PPU_CTRL_REG0, 0x00);
+    cpu_write(dev.cpu, VRAM_ADDR_REG0, x);
+    cpu_write(dev.cpu, VRAM_ADDR_REG0, y);
+}
+
+static void run_frame(Console& dev) {
+    const auto frame = dev.ppu.frames;
+    while (dev.ppu.frames == frame) {
+        ppu_clock(dev.ppu);
+    }
+}
+
+// same as console_clock does, without running the cpu
+static void run_frame_threaded(Console& dev, bool render = true) {
+    run_frame(dev);
+    render_worker_submit(*dev.render_worker, render);
+}
+
+static void wait_frame(Console& dev) {
+    while (!console_render(dev)) {
+        std::this_thread::yield();
+    }
+}
+
+static RGBAColor pixel(const Console& dev, size_t x, size_t y) {
+    return dev.screen_buf.pixels[y * dev.screen_buf.w + x];
+}
+
+static bool operator==(RGBAColor a, RGBAColor b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+TEST_CASE("ppu-registers") {
+    Console dev {};
+    console_init(dev);
+
+    SECTION("vram-read-is-buffered") {
+        vram_write(dev, 0x2001, 0x42);
+
+        cpu_write(dev.cpu, VRAM_ADDR_REG1, 0x20);
+        cpu_write(dev.cpu, VRAM_ADDR_REG1, 0x01);
+        uint8_t stale = cpu_read(dev.cpu, VRAM_IO_REG);
+        uint8_t fresh = cpu_read(dev.cpu, VRAM_IO_REG);
+
+        REQUIRE(stale == 0);
+        REQUIRE(fresh == 0x42);
+    }
+
+    SECTION("cpu-stores-dont-read-vram") {
+        // LDA #$11, STA $2007, LDX #$22, STX $2007, LDY #$33, STY $2007
+        const uint8_t code[] = {0xA9, 0x11, 0x8D, 0x07, 0x20, 0xA2, 0x22, 0x8E, 0x07, 0x20, 0xA0, 0x33, 0x8C, 0x07, 0x20};
+        for (uint16_t i = 0; i < sizeof(code); i++) {
+            ram_write(dev.ram, 0x0200 + i, code[i]);
+        }
+        cpu_write(dev.cpu, VRAM_ADDR_REG1, 0x24);
+        cpu_write(dev.cpu, VRAM_ADDR_REG1, 0x00);
+
+        dev.cpu.regs.pc = 0x0200;
+        while (dev.cpu.regs.pc < 0x0200 + sizeof(code)) {
+            dev.cpu.cycles = 0;
+            cpu_clock(dev.cpu);
+        }
+
+        REQUIRE(dev.ppu.nametables[1][0] == 0x11);
+        REQUIRE(dev.ppu.nametables[1][1] == 0x22);
+        REQUIRE(dev.ppu.nametables[1][2] == 0x33);
+        REQUIRE(dev.ppu.nametables[1][3] == 0);
+    }
+
+    SECTION("nametable-mirroring") {
+        ppu_set_mirroring(dev.ppu, Mirroring::VERTICAL);
+        vram_write(dev, 0x2400, 0x11);
+        REQUIRE(dev.ppu.nametables[3][0] == 0x11);
+        REQUIRE(dev.ppu.nametables[0][0] == 0);
+
+        ppu_set_mirroring(dev.ppu, Mirroring::SINGLE_UPPER);
+        REQUIRE(dev.ppu.nametables[0][0] == 0x11);
+
+        ppu_set_mirroring(dev.ppu, Mirroring::FOUR_SCREEN);
+        vram_write(dev, 0x2C00, 0x22);
+        REQUIRE(dev.ppu.nametables[1][0] == 0x11);
+        REQUIRE(dev.ppu.nametables[3][0] == 0x22);
+        REQUIRE(dev.ppu.nametables[0][0] == 0);
+    }
+
+    SECTION("palette-mirrors") {
+        vram_write(dev, 0x3F10, 0x2A);
+        REQUIRE(dev.ppu.universal_bg_index == 0x2A);
+
+        vram_write(dev, 0x3F15, 0x11);
+        REQUIRE(dev.ppu.sprite_palettes[1].index[1] == 0x11);
+    }
+
+    SECTION("vblank") {
+        cpu_write(dev.cpu, PPU_CTRL_REG0, 0x80);
+        run_frame(dev);
+
+        REQUIRE(dev.ppu.row == 241);
+        REQUIRE(dev.cpu.nmi_pending);
+        REQUIRE(cpu_read(dev.cpu, PPU_STS_REG) & 0x80);
+        REQUIRE((cpu_read(dev.cpu, PPU_STS_REG) & 0x80) == 0);
+    }
+}
+
+TEST_CASE("ppu-background-cache") {
+    Console dev {};
+    console_init(dev);
+
+    // tile 1 is all color 3
+    use_chr_ram(dev);
+    for (int i = 0; i < 16; i++) {
+        dev.rom.chr[16 + i] = 0xFF;
+    }
+
+    vram_write(dev, 0x3F00, 0x0F);
+    vram_write(dev, 0x3F03, 0x30);
+    vram_write(dev, 0x2000 + 2*32 + 3, 0x01); // row 2, col 3
+    cpu_write(dev.cpu, PPU_CTRL_REG1, 0x0A); // show bg, including left 8 pixels
+    scroll(dev, 0, 0);
+    run_frame(dev);
+
+    ppu_render(dev.ppu, dev.screen_buf);
+    REQUIRE(pixel(dev, 3*8, 2*8) == NES_PALETTE[0x30]);
+    REQUIRE(pixel(dev, 3*8+7, 2*8+7) == NES_PALETTE[0x30]);
+    REQUIRE(pixel(dev, 0, 0) == NES_PALETTE[0x0F]);
+    for (auto row: dev.ppu.bg.dirty_tiles) {
+        REQUIRE(row == 0);
+    }
+
+    SECTION("clean-tiles-are-not-redrawn") {
+        dev.ppu.bg.plane[0] = 3;
+        ppu_render(dev.ppu, dev.screen_buf);
+        REQUIRE(pixel(dev, 0, 0) == NES_PALETTE[0x30]);
+
+        vram_write(dev, 0x2000, 0x00);
+        ppu_render(dev.ppu, dev.screen_buf);
+        REQUIRE(pixel(dev, 0, 0) == NES_PALETTE[0x30]);
+
+        vram_write(dev, 0x2000, 0x01);
+        vram_write(dev, 0x2000, 0x00);
+        ppu_render(dev.ppu, dev.screen_buf);
+        REQUIRE(pixel(dev, 0, 0) == NES_PALETTE[0x0F]);
+    }
+
+    SECTION("attribute-marks-4x4-tiles") {
+        vram_write(dev, 0x23C0, 0b00000100); // top-right quadrant of first block uses palette 1
+        // horizontal mirroring, so the right nametable shares the same page
+        REQUIRE(dev.ppu.bg.dirty_tiles[0] == (0xF | uint64_t(0xF) << 32));
+        REQUIRE(dev.ppu.bg.dirty_tiles[3] == (0xF | uint64_t(0xF) << 32));
+        REQUIRE(dev.ppu.bg.dirty_tiles[4] == 0);
+    }
+
+    SECTION("chr-write-redraws-users") {
+        vram_write(dev, 0x0010, 0x00);
+        vram_write(dev, 0x0018, 0x00);
+        ppu_render(dev.ppu, dev.screen_buf);
+        REQUIRE(pixel(dev, 3*8, 2*8) == NES_PALETTE[0x0F]);
+        REQUIRE(pixel(dev, 3*8, 2*8+1) == NES_PALETTE[0x30]);
+    }
+
+    SECTION("sprite-chr-write-keeps-plane") {
+        dev.ppu.bg.plane[0] = 3;
+        vram_write(dev, 0x1000, 0xFF);
+        REQUIRE(dev.ppu.bg.dirty_chr[256 / 64] == 1);
+        ppu_render(dev.ppu, dev.screen_buf);
+        REQUIRE(pixel(dev, 0, 0) == NES_PALETTE[0x30]);
+        REQUIRE(dev.ppu.bg.dirty_chr[256 / 64] == 0);
+    }
+
+    SECTION("scroll") {
+        scroll(dev, 3*8, 2*8);
+        run_frame(dev);
+
+        ppu_render(dev.ppu, dev.screen_buf);
+        REQUIRE(pixel(dev, 0, 0) == NES_PALETTE[0x30]);
+        REQUIRE(pixel(dev, 8, 0) == NES_PALETTE[0x0F]);
+    }
+}
+
+TEST_CASE("render-worker") {
+    Console dev {};
+    console_init(dev);
+
+    use_chr_ram(dev);
+    for (int i = 0; i < 16; i++) {
+        dev.rom.chr[16 + i] = 0xFF;
+    }
+
+    vram_write(dev, 0x3F00, 0x0F);
+    vram_write(dev, 0x3F03, 0x30);
+    vram_write(dev, 0x2000 + 2*32 + 3, 0x01);
+    cpu_write(dev.cpu, PPU_CTRL_REG1, 0x0A);
+    scroll(dev, 0, 0);
+
+    console_set_render_worker(dev, true);
+    mu_defer(console_set_render_worker(dev, false));
+
+    run_frame_threaded(dev);
+    wait_frame(dev);
+    REQUIRE(pixel(dev, 3*8, 2*8) == NES_PALETTE[0x30]);
+    REQUIRE(pixel(dev, 0, 0) == NES_PALETTE[0x0F]);
+
+    SECTION("replays-vblank-writes") {
+        vram_write(dev, 0x3F03, 0x16);
+        vram_write(dev, 0x0010, 0x00); // chr ram, top row of tile 1 is transparent now
+        vram_write(dev, 0x0018, 0x00);
+        scroll(dev, 3*8, 2*8);
+        run_frame_threaded(dev);
+        wait_frame(dev);
+
+        REQUIRE(pixel(dev, 0, 0) == NES_PALETTE[0x0F]);
+        REQUIRE(pixel(dev, 0, 1) == NES_PALETTE[0x16]);
+        REQUIRE(pixel(dev, 8, 1) == NES_PALETTE[0x0F]);
+    }
+
+    SECTION("restarted-by-init") {
+        console_init(dev);
+        REQUIRE(dev.render_worker != nullptr);
+        REQUIRE(dev.ppu.command_log != nullptr);
+
+        cpu_write(dev.cpu, PPU_CTRL_REG1, 0x0A);
+        run_frame_threaded(dev);
+        wait_frame(dev);
+        REQUIRE(pixel(dev, 0, 0) == NES_PALETTE[0]);
+    }
+
+    SECTION("skipped-frames-stay-in-step") {
+        // written before a frame that isn't drawn, still has to show up in the next one
+        vram_write(dev, 0x0010, 0x00);
+        vram_write(dev, 0x0018, 0x00);
+        run_frame_threaded(dev, false);
+        REQUIRE(console_render(dev) == false);
+
+        vram_write(dev, 0x3F03, 0x16);
+        scroll(dev, 3*8, 2*8);
+        run_frame_threaded(dev);
+        wait_frame(dev);
+        REQUIRE(pixel(dev, 0, 0) == NES_PALETTE[0x0F]);
+        REQUIRE(pixel(dev, 0, 1) == NES_PALETTE[0x16]);
+    }
+
+    SECTION("matches-the-emulation-thread") {
+        // a palette write and a scroll split mid-frame
+        while (dev.ppu.row != 100) {
+            ppu_clock(dev.ppu);
+        }
+        vram_write(dev, 0x3F00, 0x21);
+        scroll(dev, 16, 0);
+        run_frame_threaded(dev);
+        wait_frame(dev);
+
+        // ppu_render draws the whole frame with the final palette,
+        // the worker only from the scanline it was written on
+        ScreenBuf expected = screenbuf_new(dev.screen_buf.w, dev.screen_buf.h);
+        ppu_render(dev.ppu, expected);
+        REQUIRE(pixel(dev, 0, 50) == NES_PALETTE[0x0F]);
+        const size_t from = 100 * dev.screen_buf.w;
+        REQUIRE(std::equal(dev.screen_buf.pixels.begin() + from, dev.screen_buf.pixels.end(), expected.pixels.begin() + from));
+    }
+}
+
+TEST_CASE("ppu-sprites") {
+    Console dev {};
+    console_init(dev);
+
+    // tile 1 is all color 3, tile 2 is only the leftmost column with color 1
+    use_chr_ram(dev);
+    for (int i = 0; i < 16; i++) {
+        dev.rom.chr[16 + i] = 0xFF;
+    }
+    for (int i = 0; i < 8; i++) {
+        dev.rom.chr[32 + i] = 0x80;
+    }
+
+    vram_write(dev, 0x3F00, 0x0F);
+    vram_write(dev, 0x3F03, 0x30); // bg
+    vram_write(dev, 0x3F13, 0x16); // sprite palette 0
+    vram_write(dev, 0x3F17, 0x2A); // sprite palette 1
+
+    auto put_sprite = [&](uint8_t i, uint8_t x, uint8_t y, uint8_t tile, uint8_t attr) {
+        cpu_write(dev.cpu, SPRRAM_ADDR_REG, i * 4);
+        cpu_write(dev.cpu, SPRRAM_IO_REG, y);
+        cpu_write(dev.cpu, SPRRAM_IO_REG, tile);
+        cpu_write(dev.cpu, SPRRAM_IO_REG, attr);
+        cpu_write(dev.cpu, SPRRAM_IO_REG, x);
+    };
+
+    // move all sprites off screen
+    for (uint8_t i = 0; i < 64; i++) {
+        put_sprite(i, 0, 0xFF, 0, 0);
+    }
+
+    cpu_write(dev.cpu, PPU_CTRL_REG1, 0x1E); // show bg and sprites, including left 8 pixels
+    scroll(dev, 0, 0);
+
+    SECTION("evaluation") {
+        put_sprite(0, 20, 9, 1, 0);
+        run_frame(dev);
+
+        const auto& line = dev.ppu.scanline_sprites[10];
+        REQUIRE(line.count == 1);
+        REQUIRE(line.index[0] == 0);
+        REQUIRE(line.coverage[0] == uint64_t(0xFF) << 20);
+        REQUIRE(dev.ppu.scanline_sprites[9].count == 0);
+        REQUIRE(dev.ppu.scanline_sprites[17].count == 1);
+        REQUIRE(dev.ppu.scanline_sprites[18].count == 0);
+
+        ppu_render(dev.ppu, dev.screen_buf);
+        REQUIRE(pixel(dev, 20, 10) == NES_PALETTE[0x16]);
+        REQUIRE(pixel(dev, 27, 17) == NES_PALETTE[0x16]);
+        REQUIRE(pixel(dev, 28, 10) == NES_PALETTE[0x0F]);
+    }
+
+    SECTION("overflow") {
+        for (uint8_t i = 0; i < 9; i++) {
+            put_sprite(i, i * 8, 49, 1, 0);
+        }
+        run_frame(dev);
+
+        REQUIRE(dev.ppu.scanline_sprites[50].count == 8);
+        REQUIRE(dev.ppu.scanline_sprites[50].overflow);
+        REQUIRE(cpu_read(dev.cpu, PPU_STS_REG) & 0x20);
+    }
+
+    SECTION("priority") {
+        vram_write(dev, 0x2000, 0x01); // bg tile at 0,0
+        scroll(dev, 0, 0);
+        put_sprite(0, 0, 0xFF, 0, 0);
+        put_sprite(1, 0, 0, 1, 0b00100001); // behind bg, palette 1
+        put_sprite(2, 4, 0, 1, 0); // in front, but lower priority than sprite 1
+        run_frame(dev);
+
+        ppu_render(dev.ppu, dev.screen_buf);
+        REQUIRE(pixel(dev, 0, 1) == NES_PALETTE[0x30]); // sprite 1 hidden behind bg
+        REQUIRE(pixel(dev, 5, 1) == NES_PALETTE[0x30]); // sprite 1 still hides sprite 2
+        REQUIRE(pixel(dev, 8, 1) == NES_PALETTE[0x16]); // sprite 2 shows where sprite 1 has no pixels
+        REQUIRE(pixel(dev, 0, 8) == NES_PALETTE[0x2A]); // bg is transparent below its tile
+    }
+
+    SECTION("sprite0-hit") {
+        vram_write(dev, 0x2000 + 4*32 + 2, 0x01); // bg tile at x=16..23, y=32..39
+        scroll(dev, 0, 0);
+        put_sprite(0, 20, 33, 2, 0); // only its leftmost column is opaque
+
+        run_frame(dev);
+        REQUIRE(dev.ppu.status.bits.sprite0_hit == 1);
+
+        // cleared in pre-render, then set exactly at the first overlapping pixel
+        while (!(dev.ppu.row == 34 && dev.ppu.col == 21)) {
+            ppu_clock(dev.ppu);
+        }
+        REQUIRE(dev.ppu.status.bits.sprite0_hit == 0);
+        ppu_clock(dev.ppu);
+        REQUIRE(dev.ppu.status.bits.sprite0_hit == 1);
+    }
+}
+
+TEST_CASE("oam-dma") {
+    Console dev {};
+    console_init(dev);
+
+    for (int i = 0; i < 256; i++) {
+        ram_write(dev.ram, 0x0200 + i, i);
+    }
+
+    SECTION("from-ram") {
+        dev.cpu_cycles = 0;
+        cpu_write(dev.cpu, SPRITE_DMA_REG, 0x02);
+
+        REQUIRE(memcmp(dev.ppu.oam.data(), &dev.ram[0x0200], 256) == 0);
+        REQUIRE(dev.ppu.oam[1].i == 5);
+        REQUIRE(dev.cpu.cycles == 513);
+    }
+
+    SECTION("mirrored-ram-on-odd-cycle") {
+        dev.cpu_cycles = 1;
+        cpu_write(dev.cpu, SPRITE_DMA_REG, 0x0A);
+
+        REQUIRE(memcmp(dev.ppu.oam.data(), &dev.ram[0x0200], 256) == 0);
+        REQUIRE(dev.cpu.cycles == 514);
+    }
+
+    SECTION("wraps-from-oam-addr") {
+        cpu_write(dev.cpu, SPRRAM_ADDR_REG, 0xFC);
+        cpu_write(dev.cpu, SPRITE_DMA_REG, 0x02);
+
+        REQUIRE(dev.ppu.oam[63].y == 0);
+        REQUIRE(dev.ppu.oam[0].y == 4);
+    }
+}
+
+TEST_CASE("tv-systems") {
+    Console dev {};
+    console_init(dev);
+    REQUIRE(dev.ppu.tv_system == TVSystem::NTSC);
+
+    // count dots from one vblank to the next
+    run_frame(dev);
+    auto frame_dots = [&] {
+        uint64_t dots = 0;
+        for (const auto frame = dev.ppu.frames; dev.ppu.frames == frame; dots++) {
+            ppu_clock(dev.ppu);
+        }
+        return dots;
+    };
+
+    SECTION("frame-length") {
+        REQUIRE(frame_dots() == 262 * 341);
+
+        cpu_write(dev.cpu, PPU_CTRL_REG1, 0x08);
+        const uint64_t a = frame_dots(), b = frame_dots();
+        REQUIRE(a + b == 2 * 262 * 341 - 1); // one of them skips a dot
+
+        console_set_tv_system(dev, TVSystem::PAL);
+        REQUIRE(frame_dots() == 312 * 341);
+    }
+
+    SECTION("dendy-vblank-starts-late") {
+        console_set_tv_system(dev, TVSystem::DENDY);
+        run_frame(dev);
+        run_frame(dev);
+        REQUIRE(dev.ppu.row == 291);
+    }
+
+    SECTION("cpu-divider") {
+        dev.cpu.cycles = 1000; // keep the cpu from running anything
+        for (int i = 0; i < 48; i++) {
+            console_clock(dev);
+        }
+        REQUIRE(dev.cpu_cycles == 16);
+
+        console_set_tv_system(dev, TVSystem::PAL);
+        dev.cpu_cycles = 0;
+        for (int i = 0; i < 48; i++) {
+            console_clock(dev);
+        }
+        REQUIRE(dev.cpu_cycles == 15);
+    }
+
+    SECTION("from-header") {
+        ROM rom {};
+        rom.header.flags9 = 1;
+        REQUIRE(rom_get_tv_system(rom) == TVSystem::PAL);
+
+        rom.header._padding13[1] = 'D';
+        REQUIRE(rom_get_tv_system(rom) == TVSystem::NTSC);
+
+        rom.header.flags7.bits.nes2format = 2;
+        rom.header.timing = 3;
+        REQUIRE(rom_get_tv_system(rom) == TVSystem::DENDY);
+    }
+}
@@ -0,0 +1,589 @@
+#include <catch2/catch.hpp>
+
+#include <filesystem>
+
+#include "Console.h"
+
+static mu::Str temp_path(const char* name) {
+    const auto path = (std::filesystem::temp_directory_path() / name).string();
+    return mu::Str(path.begin(), path.end());
+}
+
+static void write_file(const mu::Str& path, const mu::Vec<uint8_t>& bytes) {
+    auto file = fopen(path.c_str(), "wb");
+    REQUIRE(file != nullptr);
+    fwrite(bytes.data(), 1, bytes.size(), file);
+    fclose(file);
+}
+
+// a horizontal NROM-256 claiming to be NTSC, with dumper garbage in bytes 8-15
+static mu::Str write_ines_file(const char* name, uint8_t seed = 7) {
+    const auto path = temp_path(name);
+    auto file = fopen(path.c_str(), "wb");
+    REQUIRE(file != nullptr);
+
+    const uint8_t header[16] = {'N', 'E', 'S', 0x1A, 2, 1, 0, 0, 'D', 'i', 's', 'k', 'D', 'u', 'd', 'e'};
+    fwrite(header, 1, sizeof(header), file);
+    for (int i = 0; i < 2*16*1024 + 8*1024; i++) {
+        fputc(i * seed, file);
+    }
+    fclose(file);
+    return path;
+}
+
+static RomDbEntry db_entry_for(const ROM& rom) {
+    return RomDbEntry {
+        .crc = rom.crc,
+        .sha1 = rom_sha1(rom),
+    };
+}
+
+TEST_CASE("hashes") {
+    const auto check = (const uint8_t*) "123456789";
+    REQUIRE(crc32(check, 9) == 0xCBF43926);
+    REQUIRE(crc32(check + 4, 5, crc32(check, 4)) == 0xCBF43926);
+
+    // long enough for the folding path, checked against the byte at a time one
+    mu::Vec<uint8_t> data(1000);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = i * 31 + 7;
+    }
+    uint32_t bytewise = 0;
+    for (size_t i = 0; i < data.size(); i++) {
+        bytewise = crc32(&data[i], 1, bytewise);
+    }
+    REQUIRE(crc32(data.data(), data.size()) == bytewise);
+
+    auto sha1 = sha1_new();
+    sha1_update(sha1, (const uint8_t*) "abc", 3);
+    const SHA1Digest abc = {
+        0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+        0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d,
+    };
+    REQUIRE(sha1_final(sha1) == abc);
+}
+
+TEST_CASE("romdb") {
+    const auto rom_path = write_ines_file("nesemu-test.nes");
+    const auto db_path = temp_path("nesemu-test-romdb.bin");
+
+    ROM rom {};
+    rom_from_ines_file(rom, rom_path);
+    REQUIRE(rom.prg.size() == 2*16*1024);
+    REQUIRE(rom.chr.size() == 8*1024);
+    REQUIRE(rom_get_mirroring(rom) == Mirroring::HORIZONTAL);
+    REQUIRE(rom_get_tv_system(rom) == TVSystem::NTSC);
+
+    auto entry = db_entry_for(rom);
+    entry.mapper = 0;
+    entry.mirroring = Mirroring::VERTICAL;
+    entry.tv_system = TVSystem::DENDY;
+    entry.battery = true;
+
+    // another rom with the same crc, told apart by sha1
+    auto collision = entry;
+    collision.sha1[0] ^= 1;
+    collision.mapper = 4;
+
+    mu::Vec<RomDbEntry> entries = {collision, RomDbEntry {.crc = 1}, entry, RomDbEntry {.crc = 0xFFFFFFFF}};
+    REQUIRE(romdb_write(db_path.c_str(), entries));
+
+    RomDb db {};
+    REQUIRE(romdb_open(db, db_path.c_str()));
+    REQUIRE(db.entries.size() == 4);
+    REQUIRE(std::is_sorted(db.entries.begin(), db.entries.end(), [](auto& a, auto& b) { return a.crc < b.crc; }));
+
+    auto found = romdb_find(db, rom);
+    REQUIRE(found != nullptr);
+    REQUIRE(found->sha1 == entry.sha1);
+
+    SECTION("corrects-the-header") {
+        rom_from_ines_file(rom, rom_path, &db);
+        REQUIRE(rom_get_mapper_number(rom) == 0);
+        REQUIRE(rom_get_mirroring(rom) == Mirroring::VERTICAL);
+        REQUIRE(rom_get_tv_system(rom) == TVSystem::DENDY);
+        REQUIRE(rom.header.flags6.bits.has_battery_backed_prgram);
+        REQUIRE_FALSE(std::filesystem::exists(rom_sav_path(rom_path).c_str())); // no sav_path, no file
+    }
+
+    SECTION("unknown-rom") {
+        rom.crc ^= 1;
+        REQUIRE(romdb_find(db, rom) == nullptr);
+    }
+
+    romdb_close(db);
+    rom_free(rom);
+    std::filesystem::remove(rom_path.c_str());
+    std::filesystem::remove(db_path.c_str());
+    std::filesystem::remove(rom_sav_path(rom_path).c_str());
+}
+
+TEST_CASE("rom-index") {
+    namespace fs = std::filesystem;
+    const auto dir = temp_path("nesemu-test-library");
+    fs::remove_all(dir.c_str());
+    fs::create_directories(fs::path(dir.c_str()) / "sub");
+
+    const auto a = write_ines_file("nesemu-test-library/a.nes", 3);
+    const auto b = write_ines_file("nesemu-test-library/sub/b.NES", 5);
+    write_ines_file("nesemu-test-library/notes.txt");
+    auto junk = fopen(temp_path("nesemu-test-library/junk.nes").c_str(), "wb");
+    fputs("not a rom", junk);
+    fclose(junk);
+
+    RomIndex index {};
+    REQUIRE(rom_index_scan(index, dir.c_str(), nullptr, 4) == 3);
+    REQUIRE(index.entries.size() == 3);
+
+    auto find = [&](const RomIndex& index, mu::StrView path) -> const RomIndexEntry* {
+        for (const auto& entry : index.entries) {
+            if (mu::StrView(index.paths.data() + entry.path_offset, entry.path_size) == path) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    };
+
+    ROM rom {};
+    rom_from_ines_file(rom, b);
+    auto entry = find(index, "sub/b.NES");
+    REQUIRE(entry != nullptr);
+    REQUIRE(entry->valid);
+    REQUIRE(entry->crc == rom.crc);
+    REQUIRE(entry->prg_size == 2*16*1024);
+    REQUIRE(entry->chr_size == 8*1024);
+    REQUIRE(entry->mapper == 0);
+    REQUIRE(entry->tv_system == TVSystem::NTSC);
+    REQUIRE(entry->sha1 == rom_sha1(rom));
+
+    // a rom the database knows gets its header corrected, with the same sha1
+    auto known = db_entry_for(rom);
+    known.mapper = 1;
+    known.tv_system = TVSystem::DENDY;
+    mu::Vec<RomDbEntry> entries = {known};
+    const auto db_path = temp_path("nesemu-test-library-romdb.bin");
+    REQUIRE(romdb_write(db_path.c_str(), entries));
+    RomDb db {};
+    REQUIRE(romdb_open(db, db_path.c_str()));
+    RomIndex corrected {};
+    REQUIRE(rom_index_scan(corrected, dir.c_str(), &db, 2) == 3);
+    REQUIRE(find(corrected, "sub/b.NES")->mapper == 1);
+    REQUIRE(find(corrected, "sub/b.NES")->tv_system == TVSystem::DENDY);
+    REQUIRE(find(corrected, "sub/b.NES")->sha1 == entry->sha1);
+    REQUIRE(find(corrected, "a.nes")->mapper == 0);
+    romdb_close(db);
+    fs::remove(db_path.c_str());
+    rom_free(rom);
+
+    REQUIRE(find(index, "junk.nes") != nullptr);
+    REQUIRE_FALSE(find(index, "junk.nes")->valid);
+
+    // only what changed is hashed again
+    const auto index_path = temp_path("nesemu-test-library/.nesemu-index");
+    REQUIRE(rom_index_save(index, index_path.c_str()));
+    RomIndex loaded {};
+    REQUIRE(rom_index_load(loaded, index_path.c_str()));
+    REQUIRE(loaded.entries.size() == 3);
+    REQUIRE(rom_index_scan(loaded, dir.c_str(), nullptr, 4) == 0);
+    REQUIRE(find(loaded, "sub/b.NES")->crc == entry->crc);
+
+    write_ines_file("nesemu-test-library/a.nes", 9);
+    fs::last_write_time(a.c_str(), fs::last_write_time(a.c_str()) + std::chrono::seconds(5));
+    REQUIRE(rom_index_scan(loaded, dir.c_str(), nullptr, 4) == 1);
+    REQUIRE(find(loaded, "a.nes")->crc != find(index, "a.nes")->crc);
+
+    fs::remove_all(dir.c_str());
+}
+
+TEST_CASE("battery-ram") {
+    namespace fs = std::filesystem;
+    const auto rom_path = write_ines_file("nesemu-test-battery.nes");
+    const auto sav_path = temp_path("nesemu-test-battery.sav");
+    fs::remove(sav_path.c_str());
+
+    // set the battery bit
+    auto file = fopen(rom_path.c_str(), "r+b");
+    fseek(file, 6, SEEK_SET);
+    fputc(0b10, file);
+    fclose(file);
+
+    // in memory unless asked for the .sav
+    ROM rom {};
+    rom_from_ines_file(rom, rom_path);
+    REQUIRE(rom.prg_ram.size() == 8*1024);
+    REQUIRE(rom.sav.data == nullptr);
+    REQUIRE_FALSE(fs::exists(sav_path.c_str()));
+
+    REQUIRE(rom_sav_path(rom_path) == sav_path);
+    rom_from_ines_file(rom, rom_path, nullptr, sav_path);
+    REQUIRE(rom.prg_ram.size() == 8*1024);
+    REQUIRE(rom.prg_ram.data() == rom.sav.data);
+    REQUIRE(fs::file_size(sav_path.c_str()) == 8*1024);
+
+    // the game's writes are the file's, with no explicit save
+    REQUIRE(rom_write(rom, 0x6123, 0x42));
+    auto sav = fopen(sav_path.c_str(), "rb");
+    fseek(sav, 0x123, SEEK_SET);
+    REQUIRE(fgetc(sav) == 0x42);
+    fclose(sav);
+
+    rom_free(rom);
+    rom_from_ines_file(rom, rom_path, nullptr, sav_path);
+    uint8_t data = 0;
+    REQUIRE(rom_read(rom, 0x6123, data));
+    REQUIRE(data == 0x42);
+
+    rom_free(rom);
+    fs::remove(rom_path.c_str());
+    fs::remove(sav_path.c_str());
+}
+
+// readme.txt, then "Game (U).NES" deflated: a vertical NROM-128 where byte i of prg and chr is i % 16 + i / 8K
+static const uint8_t ZIPPED_ROM[] = {
+    0x50, 0x4b, 0x03, 0x04, 0x14, 0x00, 0x00, 0x00, 0x08, 0x00, 0xf2, 0x1d, 0x53, 0x5d, 0x86, 0xa6,
+    0x10, 0x36, 0x07, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x72, 0x65,
+    0x61, 0x64, 0x6d, 0x65, 0x2e, 0x74, 0x78, 0x74, 0xcb, 0x48, 0xcd, 0xc9, 0xc9, 0x07, 0x00, 0x50,
+    0x4b, 0x03, 0x04, 0x14, 0x00, 0x00, 0x00, 0x08, 0x00, 0xf2, 0x1d, 0x53, 0x5d, 0xbc, 0x65, 0x86,
+    0xad, 0x63, 0x00, 0x00, 0x00, 0x10, 0x60, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x00, 0x47, 0x61, 0x6d,
+    0x65, 0x20, 0x28, 0x55, 0x29, 0x2e, 0x4e, 0x45, 0x53, 0xed, 0xc7, 0xa9, 0x11, 0x80, 0x30, 0x10,
+    0x00, 0x40, 0x8e, 0xff, 0x0f, 0x58, 0xfa, 0xc1, 0x62, 0xe8, 0xbf, 0x17, 0x1c, 0x22, 0x1d, 0x64,
+    0x66, 0xd7, 0xed, 0x73, 0xbf, 0x57, 0x44, 0x54, 0xbf, 0xa8, 0x9b, 0xb6, 0xeb, 0x87, 0x71, 0x9a,
+    0x97, 0x75, 0xdb, 0x93, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb,
+    0xbb, 0xbb, 0xbb, 0x97, 0xf7, 0xac, 0x87, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb,
+    0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0x97, 0xf7, 0xac, 0xa7, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb,
+    0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0xbb, 0x97, 0xf7, 0x0f, 0x50, 0x4b, 0x01, 0x02,
+    0x14, 0x03, 0x14, 0x00, 0x00, 0x00, 0x08, 0x00, 0xf2, 0x1d, 0x53, 0x5d, 0x86, 0xa6, 0x10, 0x36,
+    0x07, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x80, 0x01, 0x00, 0x00, 0x00, 0x00, 0x72, 0x65, 0x61, 0x64, 0x6d, 0x65,
+    0x2e, 0x74, 0x78, 0x74, 0x50, 0x4b, 0x01, 0x02, 0x14, 0x03, 0x14, 0x00, 0x00, 0x00, 0x08, 0x00,
+    0xf2, 0x1d, 0x53, 0x5d, 0xbc, 0x65, 0x86, 0xad, 0x63, 0x00, 0x00, 0x00, 0x10, 0x60, 0x00, 0x00,
+    0x0c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x01, 0x2f, 0x00,
+    0x00, 0x00, 0x47, 0x61, 0x6d, 0x65, 0x20, 0x28, 0x55, 0x29, 0x2e, 0x4e, 0x45, 0x53, 0x50, 0x4b,
+    0x05, 0x06, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x02, 0x00, 0x72, 0x00, 0x00, 0x00, 0xbc, 0x00,
+    0x00, 0x00, 0x00, 0x00,
+};
+
+static void le_put(mu::Vec<uint8_t>& out, uint32_t v, int n) {
+    for (int i = 0; i < n; i++) {
+        out.push_back(v >> (i*8));
+    }
+}
+
+// a zip with data stored uncompressed under name
+static mu::Vec<uint8_t> zip_stored(mu::StrView name, const mu::Vec<uint8_t>& data) {
+    const uint32_t crc = crc32(data.data(), data.size());
+    mu::Vec<uint8_t> zip;
+    le_put(zip, 0x04034b50, 4);
+    le_put(zip, 10, 2); // version
+    le_put(zip, 0, 2); // flags
+    le_put(zip, 0, 2); // stored
+    le_put(zip, 0, 4); // time, date
+    le_put(zip, crc, 4);
+    le_put(zip, data.size(), 4);
+    le_put(zip, data.size(), 4);
+    le_put(zip, name.size(), 2);
+    le_put(zip, 0, 2);
+    zip.insert(zip.end(), name.begin(), name.end());
+    zip.insert(zip.end(), data.begin(), data.end());
+
+    const size_t central = zip.size();
+    le_put(zip, 0x02014b50, 4);
+    le_put(zip, 10, 2);
+    le_put(zip, 10, 2);
+    le_put(zip, 0, 2);
+    le_put(zip, 0, 2);
+    le_put(zip, 0, 4);
+    le_put(zip, crc, 4);
+    le_put(zip, data.size(), 4);
+    le_put(zip, data.size(), 4);
+    le_put(zip, name.size(), 2);
+    le_put(zip, 0, 2); // extra
+    le_put(zip, 0, 2); // comment
+    le_put(zip, 0, 2); // disk
+    le_put(zip, 0, 2); // internal attributes
+    le_put(zip, 0, 4); // external attributes
+    le_put(zip, 0, 4); // local header offset
+    zip.insert(zip.end(), name.begin(), name.end());
+
+    le_put(zip, 0x06054b50, 4);
+    le_put(zip, 0, 4); // disks
+    le_put(zip, 1, 2);
+    le_put(zip, 1, 2);
+    le_put(zip, zip.size() - 12 - central, 4);
+    le_put(zip, central, 4);
+    le_put(zip, 0, 2);
+    return zip;
+}
+
+TEST_CASE("zip") {
+    const auto path = temp_path("nesemu-test.zip");
+    mu::Vec<uint8_t> zip(ZIPPED_ROM, ZIPPED_ROM + sizeof(ZIPPED_ROM));
+    write_file(path, zip);
+
+    ROM rom {};
+    REQUIRE(rom_from_ines_file(rom, path) == RomError::NONE);
+    REQUIRE(rom.prg.size() == 16*1024);
+    REQUIRE(rom.chr.size() == 8*1024);
+    REQUIRE(rom_get_mirroring(rom) == Mirroring::VERTICAL);
+    size_t wrong = 0;
+    for (size_t i = 0; i < rom.prg.size() + rom.chr.size(); i++) {
+        const uint8_t byte = i < rom.prg.size() ? rom.prg[i] : rom.chr[i - rom.prg.size()];
+        wrong += byte != i % 16 + i / (8*1024);
+    }
+    REQUIRE(wrong == 0);
+
+    // the .nes central directory entry is the last one
+    size_t central = zip.size() - 4;
+    while (memcmp(&zip[central], "PK\1\2", 4) != 0) {
+        central--;
+    }
+
+    SECTION("huge-size") {
+        zip[central + 24 + 3] = 0x7F; // claims 2 GB, not allocated
+        write_file(path, zip);
+        REQUIRE(rom_from_ines_file(rom, path) == RomError::BAD_ZIP);
+        REQUIRE(rom.image.capacity() < ROM_MAX_SIZE);
+    }
+
+    SECTION("corrupt-data") {
+        zip[0x70] ^= 0xFF;
+        write_file(path, zip);
+        REQUIRE(rom_from_ines_file(rom, path) == RomError::BAD_ZIP);
+        REQUIRE(rom.prg.empty());
+    }
+
+    SECTION("stored") {
+        mu::Vec<uint8_t> nes(16 + 16*1024 + 8*1024, 0x11);
+        const uint8_t header[16] = {'N', 'E', 'S', 0x1A, 1, 1};
+        memcpy(nes.data(), header, sizeof(header));
+        write_file(path, zip_stored("Game.nes", nes));
+
+        REQUIRE(rom_from_ines_file(rom, path) == RomError::NONE);
+        REQUIRE(rom.image.empty()); // used in place
+        REQUIRE(rom.prg.size() == 16*1024);
+        REQUIRE(rom.prg[0] == 0x11);
+        REQUIRE(rom.chr[8*1024 - 1] == 0x11);
+    }
+
+    rom_free(rom);
+    std::filesystem::remove(path.c_str());
+}
+
+static void bps_number(mu::Vec<uint8_t>& out, uint64_t v) {
+    while (true) {
+        const uint8_t x = v & 0x7F;
+        v >>= 7;
+        if (v == 0) {
+            out.push_back(0x80 | x);
+            return;
+        }
+        out.push_back(x);
+        v--;
+    }
+}
+
+static void bps_crc(mu::Vec<uint8_t>& out, uint32_t crc) {
+    for (int i = 0; i < 4; i++) {
+        out.push_back(crc >> (i*8));
+    }
+}
+
+TEST_CASE("patches") {
+    namespace fs = std::filesystem;
+    const auto rom_path = write_ines_file("nesemu-test-patch.nes");
+    const auto ips_path = temp_path("nesemu-test-patch.ips");
+    const auto bps_path = temp_path("nesemu-test-patch.bps");
+
+    mu::Vec<uint8_t> source(16 + 2*16*1024 + 8*1024);
+    {
+        auto file = fopen(rom_path.c_str(), "rb");
+        REQUIRE(fread(source.data(), 1, source.size(), file) == source.size());
+        fclose(file);
+    }
+
+    SECTION("ips") {
+        // two bytes at prg[0], then a run of four 0x60 at prg[0x100]
+        write_file(ips_path, {'P', 'A', 'T', 'C', 'H', 0, 0, 16, 0, 2, 0xEA, 0xEA, 0, 0x01, 0x10, 0, 0, 0, 4, 0x60, 'E', 'O', 'F'});
+
+        ROM rom {};
+        rom_from_ines_file(rom, rom_path);
+        REQUIRE(rom.image.empty()); // patched in place
+        REQUIRE(rom.prg[0] == 0xEA);
+        REQUIRE(rom.prg[1] == 0xEA);
+        REQUIRE(rom.prg[2] == source[16 + 2]);
+        for (int i = 0x100; i < 0x104; i++) {
+            REQUIRE(rom.prg[i] == 0x60);
+        }
+        REQUIRE(rom.prg[0x104] == source[16 + 0x104]);
+        rom_free(rom);
+
+        // the rom on disk is untouched
+        auto file = fopen(rom_path.c_str(), "rb");
+        fseek(file, 16, SEEK_SET);
+        REQUIRE(fgetc(file) == source[16]);
+        fclose(file);
+
+        // past the end grows the target with zeros, a size after EOF cuts it
+        const mu::Vec<uint8_t> grow = {'P', 'A', 'T', 'C', 'H', 0, 0, 6, 0, 1, 9, 'E', 'O', 'F'};
+        mu::Vec<uint8_t> target = {1, 2, 3, 4};
+        size_t target_size;
+        REQUIRE(ips_target_size(grow.data(), grow.size(), target.size(), target_size));
+        REQUIRE(target_size == 7);
+        target.resize(target_size);
+        REQUIRE(ips_apply(grow.data(), grow.size(), target.data(), target.size()));
+        REQUIRE(target == mu::Vec<uint8_t>{1, 2, 3, 4, 0, 0, 9});
+
+        const mu::Vec<uint8_t> cut = {'P', 'A', 'T', 'C', 'H', 0, 0, 0, 0, 1, 5, 'E', 'O', 'F', 0, 0, 2};
+        REQUIRE(ips_target_size(cut.data(), cut.size(), target.size(), target_size));
+        REQUIRE(target_size == 2);
+
+        const mu::Vec<uint8_t> short_patch = {'P', 'A', 'T', 'C', 'H', 0, 0, 0, 0, 9, 5};
+        REQUIRE_FALSE(ips_target_size(short_patch.data(), short_patch.size(), target.size(), target_size));
+    }
+
+    SECTION("bps") {
+        // "HACK" over prg[0..3], prg reversed in halves, and chr a 16 byte tile repeated
+        mu::Vec<uint8_t> target = source;
+        memcpy(target.data() + 16, "HACK", 4);
+        const size_t half = 16*1024;
+        memcpy(target.data() + 16 + half, source.data() + 16, half);
+        memcpy(target.data() + 16 + 4, source.data() + 16 + half + 4, half - 4);
+        const size_t chr = 16 + 2*half;
+        for (size_t i = chr; i < target.size(); i++) {
+            target[i] = i % 16;
+        }
+
+        mu::Vec<uint8_t> patch = {'B', 'P', 'S', '1'};
+        bps_number(patch, source.size());
+        bps_number(patch, target.size());
+        bps_number(patch, 0);
+        bps_number(patch, (16 - 1) << 2 | 0); // SourceRead the header
+        bps_number(patch, (4 - 1) << 2 | 1); // TargetRead "HACK"
+        patch.insert(patch.end(), {'H', 'A', 'C', 'K'});
+        bps_number(patch, (half - 4 - 1) << 2 | 2); // SourceCopy the second half
+        bps_number(patch, (16 + half + 4) << 1);
+        bps_number(patch, (half - 1) << 2 | 2); // SourceCopy the first half, back from where it stopped
+        bps_number(patch, (2*half) << 1 | 1);
+        bps_number(patch, (16 - 1) << 2 | 1); // TargetRead one tile
+        for (int i = 0; i < 16; i++) {
+            patch.push_back(i);
+        }
+        bps_number(patch, (8*1024 - 16 - 1) << 2 | 3); // TargetCopy it over the rest of chr
+        bps_number(patch, chr << 1);
+        bps_crc(patch, crc32(source.data(), source.size()));
+        bps_crc(patch, crc32(target.data(), target.size()));
+        bps_crc(patch, crc32(patch.data(), patch.size()));
+        write_file(bps_path, patch);
+
+        ROM rom {};
+        rom_from_ines_file(rom, rom_path);
+        REQUIRE(rom.image == target);
+        REQUIRE(rom.prg.data() == rom.image.data() + 16);
+        REQUIRE(memcmp(rom.prg.data(), "HACK", 4) == 0);
+        rom_free(rom);
+
+        // a patch for another rom is refused
+        mu::Vec<uint8_t> out(target.size());
+        source[100]++;
+        REQUIRE_FALSE(bps_apply(patch.data(), patch.size(), source.data(), source.size(), out.data(), out.size()));
+        source[100]--;
+        patch[20]++;
+        REQUIRE_FALSE(bps_apply(patch.data(), patch.size(), source.data(), source.size(), out.data(), out.size()));
+    }
+
+    fs::remove(rom_path.c_str());
+    fs::remove(ips_path.c_str());
+    fs::remove(bps_path.c_str());
+}
+
+TEST_CASE("chr-ram") {
+    const auto path = temp_path("nesemu-test-chr-ram.nes");
+    mu::Vec<uint8_t> file(16 + 16*1024, 0xEA);
+    const uint8_t header[16] = {'N', 'E', 'S', 0x1A, 1, 0};
+    memcpy(file.data(), header, sizeof(header));
+    write_file(path, file);
+
+    Console dev {};
+    console_init(dev, path);
+    REQUIRE(dev.rom.chr.size() == 8*1024);
+    REQUIRE(dev.rom.chr.data() == dev.rom.chr_buf.data());
+    REQUIRE(dev.rom.crc == crc32(file.data() + 16, 16*1024));
+    REQUIRE(dev.ppu.chr_ram);
+    REQUIRE(dev.ppu.chr_banks[7] == &dev.rom.chr[7*1024]);
+
+    dev.ppu.bg.dirty_chr = {}; // mapping the banks marked them all
+    cpu_write(dev.cpu, VRAM_ADDR_REG1, 0x1F);
+    cpu_write(dev.cpu, VRAM_ADDR_REG1, 0xF0);
+    cpu_write(dev.cpu, VRAM_IO_REG, 0x42);
+    REQUIRE(dev.rom.chr[0x1FF0] == 0x42);
+    REQUIRE(dev.ppu.bg.dirty_chr[7] == uint64_t(1) << 63);
+
+    rom_free(dev.rom);
+    std::filesystem::remove(path.c_str());
+}
+
+TEST_CASE("bad-roms") {
+    const auto path = temp_path("nesemu-test-bad.nes");
+    const auto ips_path = temp_path("nesemu-test-bad.ips");
+    const auto bps_path = temp_path("nesemu-test-bad.bps");
+    std::filesystem::remove(ips_path.c_str()); // left by a run that stopped halfway
+    std::filesystem::remove(bps_path.c_str());
+    mu::Vec<uint8_t> file(16 + 16*1024 + 8*1024, 0);
+    const uint8_t header[16] = {'N', 'E', 'S', 0x1A, 1, 1};
+    memcpy(file.data(), header, sizeof(header));
+
+    ROM rom {};
+    std::filesystem::remove(path.c_str());
+    REQUIRE(rom_from_ines_file(rom, path) == RomError::UNREADABLE);
+
+    write_file(path, mu::Vec<uint8_t>(file.begin(), file.begin() + 8));
+    REQUIRE(rom_from_ines_file(rom, path) == RomError::TRUNCATED);
+
+    write_file(path, mu::Vec<uint8_t>(file.begin(), file.end() - 1));
+    REQUIRE(rom_from_ines_file(rom, path) == RomError::TRUNCATED);
+    REQUIRE(rom.prg.empty());
+
+    file[0] = 'M';
+    write_file(path, file);
+    REQUIRE(rom_from_ines_file(rom, path) == RomError::BAD_HEADER);
+    file[0] = 'N';
+
+    file[6] = 0x50; // mapper 5
+    write_file(path, file);
+    REQUIRE(rom_from_ines_file(rom, path) == RomError::UNSUPPORTED_MAPPER);
+    file[6] = 0;
+
+    file[4] = 0;
+    write_file(path, file);
+    REQUIRE(rom_from_ines_file(rom, path) == RomError::NO_PRG);
+    file[4] = 1;
+
+    write_file(path, file);
+    write_file(ips_path, {'P', 'A', 'T', 'C', 'H', 0, 0, 16, 0, 9, 1});
+    REQUIRE(rom_from_ines_file(rom, path) == RomError::BAD_PATCH);
+    std::filesystem::remove(ips_path.c_str());
+
+    // a well formed bps claiming a huge target is refused before anything is allocated
+    mu::Vec<uint8_t> huge = {'B', 'P', 'S', '1'};
+    bps_number(huge, file.size());
+    bps_number(huge, uint64_t(1) << 40);
+    bps_number(huge, 0);
+    bps_number(huge, (16 - 1) << 2 | 0);
+    bps_crc(huge, crc32(file.data(), file.size()));
+    bps_crc(huge, 0);
+    bps_crc(huge, crc32(huge.data(), huge.size()));
+    write_file(bps_path, huge);
+    REQUIRE(rom_from_ines_file(rom, path) == RomError::BAD_PATCH);
+    REQUIRE(rom.image.capacity() < ROM_MAX_SIZE);
+    std::filesystem::remove(bps_path.c_str());
+
+    // one bad rom doesn't stop the next from loading
+    Console dev {};
+    file[16] = 0xEA;
+    write_file(path, file);
+    REQUIRE(console_init(dev, path) == RomError::NONE);
+    REQUIRE(dev.rom.prg[0] == 0xEA);
+
+    rom_free(dev.rom);
+    std::filesystem::remove(path.c_str());
+}
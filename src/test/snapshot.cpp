@@ -0,0 +1,254 @@
+#include <catch2/catch.hpp>
+
+#include "Console.h"
+
+// INC $0010; JMP $8000, forever
+static void load_counter_program(Console& dev) {
+    rom_set_prg(dev.rom, mu::Vec<uint8_t>(16*1024, 0));
+    const uint8_t program[] = {0xEE, 0x10, 0x00, 0x4C, 0x00, 0x80};
+    memcpy(dev.rom.prg.data(), program, sizeof(program));
+    dev.rom.prg[RH - PRG_ROM_UP.start] = 0x00;
+    dev.rom.prg[RH - PRG_ROM_UP.start + 1] = 0x80;
+    console_reset(dev);
+}
+
+TEST_CASE("savestate") {
+    Console dev {};
+    console_init(dev);
+    load_counter_program(dev);
+    console_run_frame(dev);
+
+    mu::Vec<uint8_t> state;
+    console_save_state(dev, state);
+
+    SECTION("load-puts-everything-back") {
+        const uint8_t counter = dev.ram[0x10];
+        const uint16_t pc = dev.cpu.regs.pc;
+        const uint64_t frames = dev.ppu.frames, cycles = dev.cycles;
+
+        cpu_write(dev.cpu, VRAM_ADDR_REG1, 0x20);
+        cpu_write(dev.cpu, VRAM_ADDR_REG1, 0x00);
+        cpu_write(dev.cpu, VRAM_IO_REG, 0x42);
+        console_run_frame(dev);
+        console_run_frame(dev);
+        REQUIRE(dev.ram[0x10] != counter);
+        REQUIRE(dev.ppu.nametables[0][0] == 0x42);
+
+        REQUIRE(console_load_state(dev, state.data(), state.size()));
+        REQUIRE(dev.ram[0x10] == counter);
+        REQUIRE(dev.cpu.regs.pc == pc);
+        REQUIRE(dev.ppu.frames == frames);
+        REQUIRE(dev.cycles == cycles);
+        REQUIRE(dev.ppu.nametables[0] == &dev.ppu.ciram[0]);
+        REQUIRE(dev.ppu.nametables[0][0] == 0);
+    }
+
+    SECTION("same-layout-every-time") {
+        mu::Vec<uint8_t> again;
+        console_save_state(dev, again);
+        REQUIRE(again == state);
+
+        console_run_frame(dev);
+        REQUIRE(console_load_state(dev, state.data(), state.size()));
+        console_save_state(dev, again);
+        REQUIRE(again == state);
+    }
+
+    SECTION("chr-ram-is-kept") {
+        rom_set_chr(dev.rom, mu::Vec<uint8_t>(8*1024, 0));
+        for (uint8_t i = 0; i < dev.ppu.chr_banks.size(); i++) {
+            ppu_map_chr(dev.ppu, i, &dev.rom.chr[i * 1024]);
+        }
+        dev.ppu.chr_ram = true;
+        dev.rom.chr[0x1234] = 0x55;
+        console_save_state(dev, state);
+        REQUIRE(state.size() > 8*1024);
+
+        dev.rom.chr[0x1234] = 0xAA;
+        REQUIRE(console_load_state(dev, state.data(), state.size()));
+        REQUIRE(dev.rom.chr[0x1234] == 0x55);
+        REQUIRE(dev.ppu.chr_banks[4] == &dev.rom.chr[4 * 1024]);
+    }
+
+    SECTION("rejects-other-roms-and-versions") {
+        const uint8_t counter = dev.ram[0x10];
+        console_run_frame(dev);
+        const uint8_t later = dev.ram[0x10];
+        REQUIRE(later != counter);
+
+        dev.rom.crc ^= 1;
+        REQUIRE_FALSE(console_load_state(dev, state.data(), state.size()));
+        dev.rom.crc ^= 1;
+
+        auto other = state;
+        other[4] = SAVE_STATE_VERSION + 1;
+        REQUIRE_FALSE(console_load_state(dev, other.data(), other.size()));
+        REQUIRE_FALSE(console_load_state(dev, state.data(), state.size() - 1));
+        REQUIRE(dev.ram[0x10] == later);
+    }
+
+    SECTION("rejects-damaged-states") {
+        console_run_frame(dev);
+        const uint8_t later = dev.ram[0x10];
+        mu::Vec<uint8_t> bad;
+        auto require_rejected = [&] {
+            REQUIRE_FALSE(console_load_state(dev, bad.data(), bad.size()));
+            REQUIRE(dev.ram[0x10] == later);
+        };
+
+        dev.ppu.tv_system = TVSystem(7);
+        console_save_state(dev, bad);
+        dev.ppu.tv_system = TVSystem::NTSC;
+        require_rejected();
+
+        dev.ppu.mirroring = Mirroring(9);
+        console_save_state(dev, bad);
+        dev.ppu.mirroring = Mirroring::HORIZONTAL;
+        require_rejected();
+
+        dev.mapper.number = 4;
+        console_save_state(dev, bad);
+        dev.mapper.number = 0;
+        require_rejected();
+
+        // a chr bank past the end of a smaller chr
+        rom_set_chr(dev.rom, mu::Vec<uint8_t>(8*1024, 0));
+        ppu_map_chr(dev.ppu, 0, &dev.rom.chr[7*1024]);
+        console_save_state(dev, bad);
+        dev.rom.chr = dev.rom.chr.first(4*1024);
+        ppu_map_chr(dev.ppu, 0, &dev.rom.chr[0]);
+        require_rejected();
+    }
+
+    SECTION("run-ahead-only-keeps-the-current-frame") {
+        Console expected {};
+        console_init(expected);
+        load_counter_program(expected);
+        console_run_frame(expected);
+        console_run_frame(expected);
+
+        console_run_ahead(dev, state, 2);
+        REQUIRE(dev.ram == expected.ram);
+        REQUIRE(dev.cycles == expected.cycles);
+        REQUIRE(dev.cpu.regs.pc == expected.cpu.regs.pc);
+        REQUIRE(dev.ppu.frames == expected.ppu.frames);
+        REQUIRE(dev.ppu.row == expected.ppu.row);
+        REQUIRE(dev.ppu.col == expected.ppu.col);
+    }
+}
+
+TEST_CASE("rewind") {
+    Console dev {};
+    console_init(dev);
+    load_counter_program(dev);
+
+    // cycles at the end of each pushed frame
+    mu::Vec<uint64_t> pushed;
+    auto run = [&](Rewind& rewind, int frames) {
+        for (int i = 0; i < frames; i++) {
+            console_run_frame(dev);
+            rewind_push(rewind, dev);
+            pushed.push_back(dev.cycles);
+        }
+    };
+
+    SECTION("pops-back-in-order") {
+        auto rewind = rewind_new(1024*1024, 600, 4);
+        run(rewind, 10);
+        mu::Vec<uint8_t> latest;
+        console_save_state(dev, latest);
+
+        for (int i = 9; i >= 0; i--) {
+            REQUIRE(rewind_pop(rewind, dev));
+            REQUIRE(dev.cycles == pushed[i]);
+        }
+        REQUIRE_FALSE(rewind_pop(rewind, dev));
+
+        // going forward again after rewinding, back at the end of the first frame
+        pushed.clear();
+        run(rewind, 9);
+        mu::Vec<uint8_t> again;
+        console_save_state(dev, again);
+        REQUIRE(again == latest);
+        REQUIRE(rewind_pop(rewind, dev));
+        REQUIRE(dev.cycles == pushed.back());
+    }
+
+    SECTION("full-ring-drops-the-oldest") {
+        // keyframes are a couple of KB with noise in ram
+        for (size_t i = 0x100; i < dev.ram.size(); i++) {
+            dev.ram[i] = uint8_t(i * 2654435761u >> 13);
+        }
+        auto rewind = rewind_new(16*1024, 600, 8);
+        run(rewind, 300);
+        REQUIRE(rewind.count > 8);
+        REQUIRE(rewind.count < 300);
+        REQUIRE(rewind.frames[rewind.first].keyframe);
+
+        const size_t count = rewind.count;
+        for (size_t i = 0; i < count; i++) {
+            REQUIRE(rewind_pop(rewind, dev));
+            REQUIRE(dev.cycles == pushed[pushed.size() - 1 - i]);
+        }
+        REQUIRE_FALSE(rewind_pop(rewind, dev));
+    }
+
+    SECTION("repacked-keyframe-fits-the-ring") {
+        for (size_t i = 0x100; i < dev.ram.size(); i++) {
+            dev.ram[i] = uint8_t(i * 2654435761u >> 13);
+        }
+        auto probe = rewind_new(1024*1024, 600, 60);
+        run(probe, 1);
+        const size_t key_size = probe.frames[0].size;
+
+        // two frames at most, so the second delta drops the keyframe with the first one,
+        // and the keyframe it becomes doesn't fit after them
+        auto rewind = rewind_new(key_size + key_size / 2, 2, 60);
+        run(rewind, 3);
+        REQUIRE(rewind.count == 1);
+        const auto& frame = rewind.frames[rewind.first];
+        REQUIRE(frame.keyframe);
+        REQUIRE(frame.offset + frame.size <= rewind.ring.size());
+        REQUIRE(rewind_pop(rewind, dev));
+        REQUIRE(dev.cycles == pushed.back());
+    }
+
+    SECTION("deltas-are-small") {
+        auto rewind = rewind_new(1024*1024, 600, 60);
+        run(rewind, 2);
+        const auto& delta = rewind.frames[(rewind.first + 1) % rewind.frames.size()];
+        REQUIRE_FALSE(delta.keyframe);
+        REQUIRE(delta.size < 512);
+    }
+}
+
+TEST_CASE("write-tracking") {
+    Console dev {};
+    console_init(dev);
+
+    cpu_write(dev.cpu, 0x0845, 1); // mirror of $0045
+    cpu_write(dev.cpu, VRAM_ADDR_REG1, 0x24);
+    cpu_write(dev.cpu, VRAM_ADDR_REG1, 0x80);
+    cpu_write(dev.cpu, VRAM_IO_REG, 1);
+    cpu_write(dev.cpu, SPRRAM_ADDR_REG, 0x81);
+    cpu_write(dev.cpu, SPRRAM_IO_REG, 1);
+
+    if constexpr (WRITE_TRACKING) {
+        REQUIRE(dev.dirty.ram.words[0] == uint64_t(1) << 1);
+        const size_t ciram = dev.ppu.nametables[1] - dev.ppu.ciram.data() + 0x80;
+        REQUIRE(dev.dirty.ciram.words[0] == uint64_t(1) << (ciram / DIRTY_BLOCK));
+        REQUIRE(dev.dirty.oam.words[0] == uint64_t(1) << 2);
+
+        write_tracker_clear(dev.dirty);
+        REQUIRE(dev.dirty.ram.words[0] == 0);
+        REQUIRE_FALSE(dirty_bitmap_test(dev.dirty.ciram, ciram / DIRTY_BLOCK));
+
+        cpu_write(dev.cpu, SPRITE_DMA_REG, 0x02);
+        REQUIRE(dev.dirty.oam.words[0] == 0b1111);
+    } else {
+        // compiled away, nothing is ever marked
+        REQUIRE(dev.dirty.ram.words[0] == 0);
+        REQUIRE(dev.dirty.ciram.words[0] == 0);
+        REQUIRE(dev.dirty.oam.words[0] == 0);
+    }
+}